@@ -20,14 +20,17 @@
 #define __CLIENTSTUB_H_
 
 #include "giosocket.h"
+#include "framing.h"
 #include "immsutil.h"
 #include "clientstubbase.h"
 
 #include <stdlib.h>
 #include <errno.h>
 
+#include <algorithm>
 #include <sstream>
 #include <iostream>
+#include <vector>
 
 using std::stringstream;
 using std::ostringstream;
@@ -38,7 +41,7 @@ template <typename Ops>
 class IMMSClient : public IMMSClientStub, protected GIOSocket 
 {
 public:
-    IMMSClient() : connected(false) { }
+    IMMSClient() : connected(false), deltas(false), frames(false) { }
     bool connect()
     {
         int fd = socket_connect(get_imms_root("socket"));
@@ -46,6 +49,9 @@ public:
         {
             init(fd);
             connected = true;
+            deltas = frames = false;
+            sent.clear();
+            write_command("Version");
             write_command("IMMS");
             return true;
         }
@@ -54,6 +60,17 @@ public:
     }
     virtual void write_command(const string &line)
         { if (isok()) GIOSocket::write(line + "\n"); }
+
+    // Sends only what changed since the playlist was last sent, if the
+    // daemon can take that. Otherwise it has to ask for all of it.
+    void playlist_changed(int length)
+    {
+        if (!deltas || sent.empty() || !send_delta(length))
+        {
+            sent.clear();
+            IMMSClientStub::playlist_changed(length);
+        }
+    }
     virtual void process_line(const string &line)
     {
         stringstream sstr;
@@ -66,6 +83,15 @@ public:
         string command = "";
         sstr >> command;
 
+        if (command == "Version")
+        {
+            int major = 0, minor = 0;
+            char dot;
+            sstr >> major >> dot >> minor;
+            deltas = major > 2 || (major == 2 && minor >= 2);
+            frames = major >= 3;
+            return;
+        }
         if (command == "ResetSelection")
         {
             Ops::reset_selection();
@@ -85,7 +111,7 @@ public:
         }
         if (command == "PlaylistChanged")
         {
-            IMMSClientStub::playlist_changed(Ops::get_length());
+            playlist_changed(Ops::get_length());
             return;
         }
         if (command == "GetPlaylistItem")
@@ -97,8 +123,31 @@ public:
         }
         if (command == "GetEntirePlaylist")
         {
-            for (int i = 0; i < Ops::get_length(); ++i)
-                send_item("Playlist", i);
+            FrameWriter frame;
+            sent.resize(Ops::get_length());
+            for (int i = 0; i < (int)sent.size(); ++i)
+            {
+                sent[i] = Ops::get_item(i);
+                if (!frames)
+                {
+                    send_item("Playlist", i, sent[i]);
+                    continue;
+                }
+                if (!frame.fits(sent[i]) && frame.size())
+                {
+                    write_frame(frame.data());
+                    frame.clear();
+                }
+                // Too long to frame on its own
+                if (!frame.fits(sent[i]))
+                {
+                    send_item("Playlist", i, sent[i]);
+                    continue;
+                }
+                frame.add(i, sent[i]);
+            }
+            if (frame.size())
+                write_frame(frame.data());
             write_command("PlaylistEnd");
             return;
         }
@@ -119,14 +168,92 @@ public:
     
     bool isok() { return connected; }
 private:
-    bool connected;
+    bool connected, deltas, frames;
+    // The playlist as the daemon last heard of it
+    std::vector<string> sent;
 
     void send_item(const char *command, int i)
+        { send_item(command, i, Ops::get_item(i)); }
+    void send_item(const char *command, int i, const string &path)
     {
         ostringstream osstr;
-        osstr << command << " " << i << " " << Ops::get_item(i);
+        osstr << command << " " << i << " " << path;
         write_command(osstr.str());
     }
+
+    // The daemon hashes the paths it has for the changed range, and the
+    // one on either side of it, to make sure it has the same playlist.
+    unsigned hash_range(int pos, int count)
+    {
+        unsigned hash = PATH_HASH_SEED;
+        int end = std::min(pos + count + 1, (int)sent.size());
+        for (int i = std::max(pos - 1, 0); i < end; ++i)
+            hash = hash_path(path_normalize(sent[i]), hash);
+        return hash;
+    }
+
+    bool send_delta(int length)
+    {
+        std::vector<string> now(length);
+        for (int i = 0; i < length; ++i)
+            now[i] = Ops::get_item(i);
+
+        // Whatever is the same at both ends was left alone
+        int oldlength = sent.size(), common = std::min(oldlength, length);
+        int head = 0, tail = 0;
+        while (head < common && now[head] == sent[head])
+            ++head;
+        while (tail < common - head
+                && now[length - tail - 1] == sent[oldlength - tail - 1])
+            ++tail;
+
+        int removed = oldlength - head - tail;
+        int inserted = length - head - tail;
+        // The daemon already has all of it
+        if (!removed && !inserted)
+            return true;
+
+        // Cheaper to send it all again once most of it is new
+        int by = removed == inserted ? find_rotation(head, now, removed) : 0;
+        if (!by && inserted > length / 2)
+            return false;
+
+        unsigned hash = hash_range(head, removed);
+
+        ostringstream osstr;
+        if (by)
+        {
+            osstr << "PlaylistMove " << head << " " << removed << " " << by
+                << " " << oldlength << " " << hash;
+            write_command(osstr.str());
+        }
+        else
+        {
+            osstr << "PlaylistSplice " << head << " " << removed << " "
+                << inserted << " " << oldlength << " " << hash;
+            write_command(osstr.str());
+            for (int i = head; i < head + inserted; ++i)
+                write_command("SpliceItem " + now[i]);
+        }
+
+        sent.swap(now);
+        return true;
+    }
+
+    // If the count items at pos were only moved around, returns by how
+    // many places they were rotated; 0 otherwise.
+    int find_rotation(int pos, const std::vector<string> &now, int count)
+    {
+        for (int by = 1; by < count; ++by)
+        {
+            int i = 0;
+            while (i < count && now[pos + i] == sent[pos + (i + by) % count])
+                ++i;
+            if (i == count)
+                return by;
+        }
+        return 0;
+    }
 };
 
 #endif
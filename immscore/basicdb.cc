@@ -24,6 +24,7 @@
 #include "strmanip.h"
 #include "immsdb.h"
 #include "immsutil.h"
+#include "song.h"
 
 using std::endl;
 using std::cerr; 
@@ -36,6 +37,7 @@ BasicDb::BasicDb()
 
 BasicDb::~BasicDb()
 {
+    Song::flush_lastseen();
 }
 
 void BasicDb::sql_set_pragma()
@@ -117,6 +119,12 @@ void BasicDb::sql_create_tables()
                 "'trials' INTEGER NOT NULL);").execute();
 
         Q("CREATE INDEX Bias_uid_i ON Bias (uid);").execute();
+
+        Q("CREATE TABLE RatingState ("
+                "'uid' INTEGER PRIMARY KEY, "
+                "'recent' BLOB NOT NULL, "
+                "'biasmean' REAL NOT NULL, "
+                "'biastrials' REAL NOT NULL);").execute();
     }
     WARNIFFAILED();
 }
@@ -185,4 +193,13 @@ void BasicDb::sql_schema_upgrade(int from)
         a.commit();
     }
     IGNOREFAILURE();  // Temporary hack to work around broken schema upgrades.
+
+    // Rebuilt from the Journal on demand
+    if (from < 16)
+    {
+        try {
+            Q("DELETE FROM RatingState;").execute();
+        }
+        IGNOREFAILURE();
+    }
 }
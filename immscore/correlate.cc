@@ -30,16 +30,26 @@ using std::endl;
 using std::cerr;
 
 #define CORRELATION_TIME    (15*30)   // n * 30 ==> n minutes
-#define MAX_CORR_STR        "12"
 #define MAX_CORRELATION     12
 #define SECOND_DEGREE       0.5
-#define PROCESSING_TIME     5000000
-
-CorrelationDb::CorrelationDb() : correlate_from(time(0))
+#define TICK_BUDGET         5000      // usec of work per main loop tick
+#define MIN_CORRELATION     0.25
+#define HALF_LIFE           (365*DAY)
+#define MAX_DEGREE          256
+#define COMPACTION_INTERVAL DAY
+
+CorrelationDb::CorrelationDb()
+    : correlate_from(time(0)), last_compaction(-1), compaction_started(0),
+      compaction_free_pages(0), journal_pos(0), expire_pending(false)
 {
     gettimeofday(&start, 0);
 }
 
+CorrelationDb::~CorrelationDb()
+{
+    graph.flush();
+}
+
 void CorrelationDb::sql_create_tables()
 {
     RuntimeErrorBlocker reb;
@@ -49,20 +59,32 @@ void CorrelationDb::sql_create_tables()
                 "'y' INTEGER NOT NULL, "
                 "'weight' INTEGER DEFAULT '0');").execute();
 
-        Q("CREATE TEMP TABLE TmpCorr ("
-                "'x' INTEGER NOT NULL, "
-                "'y' INTEGER NOT NULL, "
-                "'weight' INTEGER DEFAULT '0');").execute();
-
         Q("CREATE UNIQUE INDEX C.Correlations_x_y_i "
                 "ON Correlations (x, y);").execute();
-
-        Q("CREATE INDEX C.Correlations_x_i ON Correlations (x);").execute();
-        Q("CREATE INDEX C.Correlations_y_i ON Correlations (y);").execute();
     }
     WARNIFFAILED();
 }
 
+void CorrelationDb::sql_schema_upgrade(int from)
+{
+    try
+    {
+        AutoTransaction a;
+        // Neighbours are looked up in the in memory graph, so only the
+        // (x, y) index is still used, by the writes
+        if (from < 17)
+        {
+            Q("DROP INDEX IF EXISTS C.Correlations_x_i;").execute();
+            Q("DROP INDEX IF EXISTS C.Correlations_y_i;").execute();
+            Q("DROP INDEX IF EXISTS C.Correlations_x_weight_i;").execute();
+            Q("DROP INDEX IF EXISTS C.Correlations_y_weight_i;").execute();
+        }
+
+        a.commit();
+    }
+    IGNOREFAILURE();  // Temporary hack to work around broken schema upgrades.
+}
+
 void CorrelationDb::add_recent(int uid, time_t skipped_at, int flags)
 {
     if (uid > -1)
@@ -78,27 +100,43 @@ void CorrelationDb::add_recent(int uid, time_t skipped_at, int flags)
 
 void CorrelationDb::get_related(vector<int> &out, int pivot_sid, int limit)
 {
-    string query =
-        "SELECT pos FROM Filter NATURAL INNER JOIN Library "
-            "WHERE sid IN ("
-            "SELECT L.sid FROM C.Correlations AS C INNER JOIN Last AS L "
-                "ON CASE WHEN C.x = ? THEN C.y ELSE C.x END = L.sid "
-            "WHERE C.weight > 0 AND (C.x = ? OR C.y = ?) AND L.last > ? "
-            "ORDER BY C.weight DESC LIMIT " + itos(limit) + ");";
+    vector<int> related;
+    graph.get_top(pivot_sid, related);
+    if (related.empty())
+        return;
 
-    try {
-        Q q(query);
+    select_related(out, related, limit);
+
+    // The filters may have thrown out most of the strongest neighbours,
+    // in which case the weaker ones get their turn
+    if ((int)out.size() >= limit || related.size() < TOP_NEIGHBOURS)
+        return;
 
-        q << pivot_sid << pivot_sid << pivot_sid << (time(0) - HOUR);
+    related.clear();
+    graph.get_ranked(pivot_sid, related);
+    out.clear();
+    select_related(out, related, limit);
+}
 
-        while (q.next())
+void CorrelationDb::select_related(vector<int> &out,
+        const vector<int> &related, int limit)
+{
+    vector<int> recent;
+    try {
+        time_t cutoff = time(0) - HOUR;
+        for (unsigned i = 0; i < related.size()
+                && (int)recent.size() < limit; ++i)
         {
-            int pos;
-            q >> pos;
-            out.push_back(pos);
+            Q q("SELECT 1 FROM Last WHERE sid = ? AND last > ?;");
+            q << related[i] << cutoff;
+            if (q.next())
+                recent.push_back(related[i]);
         }
     }
     WARNIFFAILED();
+
+    if (!recent.empty())
+        get_filtered_positions(recent, out);
 }
 
 void CorrelationDb::maybe_expire_recent()
@@ -106,61 +144,199 @@ void CorrelationDb::maybe_expire_recent()
     struct timeval now;
     gettimeofday(&now, 0);
 
-    if (usec_diff(start, now) < 10000000)
+    // A backlog or a compaction is worked through a slice per tick,
+    // otherwise new plays are picked up every 10 seconds
+    if (!expire_pending && !graph.is_compacting()
+            && usec_diff(start, now) < 10000000)
         return;
 
     start = now;
 
-    expire_recent(time(0) - CORRELATION_TIME);
+    expire_pending = !expire_recent(time(0) - CORRELATION_TIME, TICK_BUDGET);
+    if (!expire_pending)
+        maybe_compact_correlations();
 }
 
-void CorrelationDb::expire_recent(time_t cutoff)
+void CorrelationDb::clear_recent()
 {
-#if 0 && defined(DEBUG)
-    cerr << "Running expire recent..." << endl;
-    StackTimer t;
-#endif
+    expire_recent(INT_MAX);
+    expire_pending = false;
+    window.clear();
+}
+
+void CorrelationDb::maybe_compact_correlations()
+{
+    if (!graph.is_compacting())
+    {
+        if (last_compaction == -1)
+            last_compaction = sql_get_timestamp("compacted");
+
+        if (last_compaction
+                && time(0) - last_compaction < COMPACTION_INTERVAL)
+            return;
+
+        begin_compaction();
+    }
+
+    // A failed slice is retried on the next tick
+    if (graph.compact(TICK_BUDGET, &compaction) <= 0)
+        return;
+
+    finish_compaction();
+
+    LOG(INFO) << "Compacted correlations: " << compaction.pruned
+        << " pruned, " << compaction.capped << " capped out of "
+        << compaction.edges << ", " << compaction.bytes_freed / 1024
+        << "KB freed" << endl;
+}
+
+bool CorrelationDb::compact_correlations(CompactionStats *stats)
+{
+    begin_compaction();
+    if (graph.compact(0, &compaction) < 0)
+        return false;
+    finish_compaction();
+    *stats = compaction;
+    return true;
+}
+
+void CorrelationDb::begin_compaction()
+{
+    compaction_started = time(0);
+    time_t previous = sql_get_timestamp("compacted");
+
+    // Weights halve every HALF_LIFE, applied for the time since the last
+    // compaction
+    float decay = 1;
+    if (previous && previous < compaction_started)
+        decay = pow(0.5, double(compaction_started - previous) / HALF_LIFE);
+
+    compaction = CompactionStats();
+    compaction_free_pages = sql_free_pages();
+    graph.begin_compaction(decay, MIN_CORRELATION, MAX_DEGREE, &compaction);
+}
+
+void CorrelationDb::finish_compaction()
+{
+    compaction.bytes_freed =
+        long(sql_free_pages() - compaction_free_pages) * sql_page_size();
 
     try {
-        AutoTransaction a;
+        Q q("INSERT OR REPLACE INTO 'Schema' ('description', 'version') "
+                "VALUES ('compacted', ?);");
+        q << compaction_started;
+        q.execute();
+    }
+    WARNIFFAILED();
+
+    last_compaction = compaction_started;
+}
 
-        while (1)
+time_t CorrelationDb::sql_get_timestamp(const string &description)
+{
+    time_t result = 0;
+    try {
+        Q q("SELECT version FROM 'Schema' WHERE description = ?;");
+        q << description;
+        if (q.next())
+            q >> result;
+    }
+    WARNIFFAILED();
+    return result;
+}
+
+int CorrelationDb::sql_free_pages()
+{
+    int pages = 0;
+    try {
+        Q q("PRAGMA C.freelist_count;");
+        if (q.next())
+            q >> pages;
+    }
+    WARNIFFAILED();
+    return pages;
+}
+
+int CorrelationDb::sql_page_size()
+{
+    int size = 0;
+    try {
+        Q q("PRAGMA C.page_size;");
+        if (q.next())
+            q >> size;
+    }
+    WARNIFFAILED();
+    return size;
+}
+
+bool CorrelationDb::expire_recent(time_t cutoff, uint64_t budget)
+{
+    struct timeval begin, now;
+    gettimeofday(&begin, 0);
+
+    bool done = true;
+
+    try {
+        // Journal rows are appended as plays happen, so rowid order is time
+        // order, and resuming from the last row read is a range scan
+        Q q("SELECT Journal.rowid, Library.sid, Journal.played, "
+                "Journal.flags, Journal.time "
+                "FROM Journal INNER JOIN Library "
+                "ON Journal.uid = Library.uid "
+                "WHERE Journal.rowid > ? AND Journal.time > ? "
+                "ORDER BY Journal.rowid ASC;");
+        q << journal_pos << correlate_from;
+
+        for (bool first = true; q.next(); first = false)
         {
-            Q q("SELECT Library.sid, Journal.played, "
-                    "Journal.flags, Journal.time "
-                    "FROM Journal INNER JOIN Library "
-                    "ON Journal.uid = Library.uid "
-                    "WHERE Journal.time > ? ORDER BY Journal.time ASC;");
-            q << correlate_from;
-
-            if (!q.next())
-                break;
+            // Always make some progress
+            if (budget && !first)
+            {
+                gettimeofday(&now, 0);
+                if (usec_diff(begin, now) > budget)
+                {
+                    done = false;
+                    break;
+                }
+            }
 
+            RecentPlay play;
             int flags;
-            time_t next, played;
+            long rowid;
+            time_t played;
 
-            q >> from >> played >> flags >> next;
-            from_weight = Flags::deltify(played, flags);
+            q >> rowid >> play.sid >> played >> flags >> play.time;
+            play.weight = Flags::deltify(played, flags);
 
-            if (next > cutoff) 
+            // Pairs with plays that have yet to happen, wait for them
+            if (play.time > cutoff)
                 break;
 
-            correlate_from = next + 1;
+            journal_pos = rowid;
 
-            if (from_weight == -1)
+            while (!window.empty()
+                    && window.front().time + CORRELATION_TIME < play.time)
+                window.pop_front();
+
+            if (play.weight == -1)
                 continue;
 
-            while (q.next())
+            to = play.sid;
+            to_weight = play.weight;
+            for (unsigned i = 0; i < window.size(); ++i)
             {
-                q >> to >> played >> flags;
-                to_weight = Flags::deltify(played, flags);
+                from = window[i].sid;
+                from_weight = window[i].weight;
                 expire_recent_helper();
             }
-        }
 
-        a.commit();
+            window.push_back(play);
+        }
     }
     WARNIFFAILED();
+
+    graph.flush();
+    return done;
 }
 
 void CorrelationDb::expire_recent_helper()
@@ -185,36 +361,19 @@ void CorrelationDb::expire_recent_helper()
     // Update the primary link
     update_correlation(from, to, weight);
 
-    struct timeval now;
-    gettimeofday(&now, 0);
-
-    if (usec_diff(start, now) > PROCESSING_TIME || fabs(weight) < 2)
+    if (fabs(weight) < 2)
         return;
     
-    try {
-        Q("DELETE FROM TmpCorr;").execute();
-    } IGNOREFAILURE();
-
-    {
-        string query("INSERT INTO TmpCorr SELECT x, y, weight "
-            "FROM C.Correlations "
-            "WHERE (x IN (?, ?) OR y IN (?, ?)) AND ");
-        query += (weight > 0 ? string("abs") : string("")) + " (weight) > 1;";
-
-        Q q(query);
-        q << to << from << to << from;
-        q.execute();
-    }
+    // Snapshot the neighbours, the updates below add to them
+    vector<CorrelationEdge> edges;
+    graph.get_edges(to, edges);
+    graph.get_edges(from, edges);
 
+    for (unsigned i = 0; i < edges.size(); ++i)
     {
-        Q q("SELECT * FROM TmpCorr;");
-        while (q.next())
-        {
-            int node1, node2;
-            float outer;
-            q >> node1 >> node2 >> outer;
-            update_secondary_correlations(node1, node2, outer);
-        }
+        const CorrelationEdge &e = edges[i];
+        if ((weight > 0 ? fabs(e.weight) : e.weight) > 1)
+            update_secondary_correlations(e.x, e.y, e.weight);
     }
 }
 
@@ -236,7 +395,7 @@ void CorrelationDb::update_secondary_correlations(int node1, int node2,
 
 void CorrelationDb::update_correlation(int from, int to, float weight)
 {
-    if (fabs(weight) < 0.25)
+    if (fabs(weight) < MIN_CORRELATION)
         return;
 
 #if defined(DEBUG) && 0
@@ -244,23 +403,7 @@ void CorrelationDb::update_correlation(int from, int to, float weight)
         << std::max(from, to) << " by " << weight << endl;
 #endif
 
-    int min = std::min(from, to), max = std::max(from, to);
-
-    try {
-        Q q("INSERT INTO C.Correlations "
-                "('x', 'y', 'weight') VALUES (?, ?, ?);");
-        q << min << max << weight;
-        q.execute();
-        return;
-    } IGNOREFAILURE();
-
-    {
-        Q q("UPDATE C.Correlations SET weight = "
-                "max(min(weight + ?, " MAX_CORR_STR "), -" MAX_CORR_STR ") "
-                "WHERE x = ? AND y = ?;");
-        q << weight << min << max;
-        q.execute();
-    }
+    graph.add(from, to, weight, MAX_CORRELATION);
 }
 
 float CorrelationDb::correlate(int sid1, int sid2)
@@ -268,17 +411,5 @@ float CorrelationDb::correlate(int sid1, int sid2)
     if (sid1 < 0 || sid2 < 0)
         return 0;
 
-    int min = std::min(sid1, sid2), max = std::max(sid1, sid2);
-    float correlation = 0;
-    
-    try {
-        Q q("SELECT weight FROM C.Correlations WHERE x = ? AND y = ?;");
-        q << min << max;
-
-        if (q.next())
-            q >> correlation;
-    }
-    WARNIFFAILED();
-
-    return correlation;
+    return graph.get(sid1, sid2);
 }
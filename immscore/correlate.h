@@ -22,10 +22,12 @@
 #include <sys/time.h>
 #include <string>
 #include <vector>
+#include <deque>
 #include <climits>
 
 #include "immsconf.h"
 #include "basicdb.h"
+#include "corrgraph.h"
 
 using std::string;
 
@@ -33,29 +35,69 @@ class CorrelationDb : virtual public BasicDb
 {
 public:
     CorrelationDb();
+    virtual ~CorrelationDb();
 
     float correlate(int sid1, int sid2);
     void add_recent(int uid, time_t skipped_at, int flags);
-    void clear_recent() { expire_recent(INT_MAX); }
-    void expire_recent(time_t cutoff);
+    void clear_recent();
     void maybe_expire_recent();
 
+    // Correlates the journal up to cutoff, stopping early once budget
+    // usecs have passed if given. Returns false if work is left over.
+    bool expire_recent(time_t cutoff, uint64_t budget = 0);
+
+    // Decays the correlations for the time since the last compaction,
+    // then prunes the weak ones and caps the number per song, all at once.
+    // immsd does the same a slice per tick instead. Returns false if the
+    // database refused part of it.
+    bool compact_correlations(CompactionStats *stats);
+
 protected:
     void update_correlation(int from, int to, float weight);
     void expire_recent_helper();
     void update_secondary_correlations(int from, int to, float outer);
 
     void get_related(std::vector<int> &out, int pivot_sid, int limit);
+    // Playlist positions of the first limit of the ranked sids to have
+    // been played within the last hour
+    void select_related(std::vector<int> &out,
+            const std::vector<int> &related, int limit);
+    // Appends the playlist positions of sids that pass the filter
+    virtual void get_filtered_positions(const std::vector<int> &sids,
+            std::vector<int> &out) = 0;
+
+    void maybe_compact_correlations();
+    void begin_compaction();
+    void finish_compaction();
+    time_t sql_get_timestamp(const string &description);
+    int sql_free_pages();
+    int sql_page_size();
 
     virtual void sql_create_tables();
-    virtual void sql_schema_upgrade(int from = 0) {}
+    virtual void sql_schema_upgrade(int from = 0);
 
 private:
+    struct RecentPlay {
+        int sid, weight;
+        time_t time;
+    };
+
+    time_t correlate_from, last_compaction, compaction_started;
+    CompactionStats compaction;
+    int compaction_free_pages;
+    long journal_pos;
+    bool expire_pending;
+
+    // Plays in the last CORRELATION_TIME before the journal position,
+    // which still pair with the ones coming after it
+    std::deque<RecentPlay> window;
+
     // shared within callbacks
-    time_t correlate_from;
     int from, from_weight, to, to_weight;
     float weight;
     struct timeval start;
+
+    CorrelationGraph graph;
 };
 
 #endif
@@ -0,0 +1,514 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <limits.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "corrgraph.h"
+#include "sqlite++.h"
+#include "immsutil.h"
+
+using std::vector;
+using std::endl;
+using std::cerr;
+
+#define INITIAL_BITS    12
+
+CorrelationGraph::CorrelationGraph()
+    : loaded(false), bits(0), used(0), compacting(false) {}
+
+uint64_t CorrelationGraph::make_key(int sid1, int sid2)
+{
+    uint32_t x = std::min(sid1, sid2), y = std::max(sid1, sid2);
+    return ((uint64_t)x << 32) | y;
+}
+
+static inline size_t home_slot(uint64_t key, int bits)
+{
+    return (key * 11400714819323198485ULL) >> (64 - bits);
+}
+
+// Linear probing from a Fibonacci hash of the key. Returns either the
+// slot holding the key or the empty slot where it belongs.
+CorrelationGraph::Slot &CorrelationGraph::find(uint64_t key)
+{
+    size_t mask = slots.size() - 1;
+    size_t i = home_slot(key, bits);
+    while (slots[i].key && slots[i].key != key)
+        i = (i + 1) & mask;
+    return slots[i];
+}
+
+CorrelationGraph::Slot &CorrelationGraph::insert(uint64_t key, float weight)
+{
+    // Keep the load factor under 3/4
+    if ((used + 1) * 4 > slots.size() * 3)
+        grow();
+
+    Slot &slot = find(key);
+    if (slot.key)
+        return slot;
+
+    slot.key = key;
+    slot.weight = weight;
+    slot.dirty = false;
+    ++used;
+
+    int x = key >> 32, y = key & 0xFFFFFFFF;
+    neighbours[x].push_back(y);
+    neighbours[y].push_back(x);
+    return slot;
+}
+
+static void remove_neighbour(vector<int> &others, int sid)
+{
+    vector<int>::iterator i = std::find(others.begin(), others.end(), sid);
+    if (i == others.end())
+        return;
+    *i = others.back();
+    others.pop_back();
+}
+
+void CorrelationGraph::erase(uint64_t key)
+{
+    Slot *slot = &find(key);
+    if (!slot->key)
+        return;
+
+    int x = key >> 32, y = key & 0xFFFFFFFF;
+    remove_neighbour(neighbours[x], y);
+    remove_neighbour(neighbours[y], x);
+
+    stale_top(x);
+    stale_top(y);
+
+    // Shift back the slots that probed past this one, so that lookups
+    // don't stop at the hole
+    size_t mask = slots.size() - 1;
+    size_t hole = slot - &slots[0];
+    for (size_t i = (hole + 1) & mask; slots[i].key; i = (i + 1) & mask)
+    {
+        size_t home = home_slot(slots[i].key, bits);
+        bool stays = hole < i ? hole < home && home <= i
+            : hole < home || home <= i;
+        if (stays)
+            continue;
+        slots[hole] = slots[i];
+        hole = i;
+    }
+
+    Slot empty = { 0, 0, false };
+    slots[hole] = empty;
+    --used;
+}
+
+void CorrelationGraph::grow()
+{
+    vector<Slot> old;
+    old.swap(slots);
+
+    bits = bits ? bits + 1 : INITIAL_BITS;
+    Slot empty = { 0, 0, false };
+    slots.resize((size_t)1 << bits, empty);
+
+    for (vector<Slot>::iterator i = old.begin(); i != old.end(); ++i)
+        if (i->key)
+            find(i->key) = *i;
+}
+
+void CorrelationGraph::reset()
+{
+    loaded = false;
+    bits = 0;
+    used = 0;
+    slots.clear();
+    neighbours.clear();
+    dirty.clear();
+    top.clear();
+    compacting = false;
+}
+
+void CorrelationGraph::load()
+{
+    loaded = true;
+    grow();
+
+    try {
+        Q q("SELECT x, y, weight FROM C.Correlations;");
+        while (q.next())
+        {
+            int x, y;
+            float weight;
+            q >> x >> y >> weight;
+            if (x != y)
+                insert(make_key(x, y), weight);
+        }
+    }
+    WARNIFFAILED();
+}
+
+float CorrelationGraph::get(int sid1, int sid2)
+{
+    if (!loaded)
+        load();
+    return find(make_key(sid1, sid2)).weight;
+}
+
+float CorrelationGraph::add(int sid1, int sid2, float delta, float limit)
+{
+    if (!loaded)
+        load();
+
+    uint64_t key = make_key(sid1, sid2);
+    Slot &slot = insert(key, 0);
+    slot.weight = std::max(std::min(slot.weight + delta, limit), -limit);
+
+    if (!slot.dirty)
+    {
+        slot.dirty = true;
+        dirty.push_back(key);
+    }
+
+    update_top(sid1, sid2, slot.weight);
+    update_top(sid2, sid1, slot.weight);
+    return slot.weight;
+}
+
+static bool stronger_neighbour(const std::pair<float, int> &a,
+        const std::pair<float, int> &b)
+{
+    return a.first > b.first;
+}
+
+void CorrelationGraph::update_top(int sid, int other, float weight)
+{
+    std::map<int, TopList>::iterator i = top.find(sid);
+    if (i == top.end() || i->second.stale)
+        return;
+
+    TopList &list = i->second;
+    vector<Neighbour> &entries = list.entries;
+    bool full = entries.size() == TOP_NEIGHBOURS;
+
+    unsigned pos = 0;
+    while (pos < entries.size() && entries[pos].second != other)
+        ++pos;
+
+    if (pos < entries.size())
+    {
+        // Something that didn't make the list might be stronger now
+        if (weight <= 0 || (full && weight < entries.back().first))
+        {
+            list.stale = true;
+            return;
+        }
+        entries[pos].first = weight;
+    }
+    else
+    {
+        if (weight <= 0 || (full && weight <= entries.back().first))
+            return;
+        if (full)
+            entries.pop_back();
+        entries.push_back(Neighbour(weight, other));
+    }
+
+    std::stable_sort(entries.begin(), entries.end(), stronger_neighbour);
+}
+
+void CorrelationGraph::stale_top(int sid)
+{
+    std::map<int, TopList>::iterator i = top.find(sid);
+    if (i != top.end())
+        i->second.stale = true;
+}
+
+void CorrelationGraph::rebuild_top(int sid, TopList &list)
+{
+    list.stale = false;
+    list.entries.clear();
+
+    std::map<int, vector<int> >::iterator i = neighbours.find(sid);
+    if (i == neighbours.end())
+        return;
+
+    const vector<int> &others = i->second;
+    for (unsigned j = 0; j < others.size(); ++j)
+    {
+        float weight = find(make_key(sid, others[j])).weight;
+        if (weight > 0)
+            list.entries.push_back(Neighbour(weight, others[j]));
+    }
+
+    unsigned n = std::min<size_t>(list.entries.size(), TOP_NEIGHBOURS);
+    std::partial_sort(list.entries.begin(), list.entries.begin() + n,
+            list.entries.end(), stronger_neighbour);
+    list.entries.resize(n);
+}
+
+void CorrelationGraph::get_top(int sid, vector<int> &out)
+{
+    if (!loaded)
+        load();
+
+    TopList &list = top[sid];
+    if (list.stale)
+        rebuild_top(sid, list);
+
+    for (unsigned i = 0; i < list.entries.size(); ++i)
+        out.push_back(list.entries[i].second);
+}
+
+void CorrelationGraph::get_ranked(int sid, vector<int> &out)
+{
+    if (!loaded)
+        load();
+
+    std::map<int, vector<int> >::iterator i = neighbours.find(sid);
+    if (i == neighbours.end())
+        return;
+
+    vector<Neighbour> entries;
+    const vector<int> &others = i->second;
+    for (unsigned j = 0; j < others.size(); ++j)
+    {
+        float weight = find(make_key(sid, others[j])).weight;
+        if (weight > 0)
+            entries.push_back(Neighbour(weight, others[j]));
+    }
+
+    std::stable_sort(entries.begin(), entries.end(), stronger_neighbour);
+    for (unsigned j = 0; j < entries.size(); ++j)
+        out.push_back(entries[j].second);
+}
+
+void CorrelationGraph::get_edges(int sid, vector<CorrelationEdge> &out)
+{
+    if (!loaded)
+        load();
+
+    std::map<int, vector<int> >::iterator i = neighbours.find(sid);
+    if (i == neighbours.end())
+        return;
+
+    const vector<int> &others = i->second;
+    for (unsigned j = 0; j < others.size(); ++j)
+    {
+        CorrelationEdge edge;
+        edge.x = std::min(sid, others[j]);
+        edge.y = std::max(sid, others[j]);
+        edge.weight = find(make_key(sid, others[j])).weight;
+        out.push_back(edge);
+    }
+}
+
+void CorrelationGraph::flush()
+{
+    if (dirty.empty())
+        return;
+
+    bool written = false;
+    try {
+        AutoTransaction a;
+
+        for (unsigned i = 0; i < dirty.size(); ++i)
+        {
+            const Slot &slot = find(dirty[i]);
+            // Dropped by compaction since
+            if (slot.key != dirty[i])
+                continue;
+            Q q("INSERT OR REPLACE INTO C.Correlations "
+                    "('x', 'y', 'weight') VALUES (?, ?, ?);");
+            q << int(slot.key >> 32) << int(slot.key & 0xFFFFFFFF)
+                << slot.weight;
+            q.execute();
+        }
+
+        a.commit();
+        written = true;
+    }
+    WARNIFFAILED();
+
+    // Keep everything dirty to be retried on the next flush
+    if (!written)
+        return;
+
+    for (unsigned i = 0; i < dirty.size(); ++i)
+        find(dirty[i]).dirty = false;
+    dirty.clear();
+}
+
+typedef std::pair<float, uint64_t> RankedEdge;
+
+static bool stronger(const RankedEdge &a, const RankedEdge &b)
+{
+    return a.first > b.first;
+}
+
+void CorrelationGraph::begin_compaction(float decay, float threshold,
+        int max_degree, CompactionStats *stats)
+{
+    if (!loaded)
+        load();
+
+    compacting = true;
+    compact_decay = decay;
+    compact_threshold = threshold;
+    compact_degree = max_degree;
+    compact_cursor = INT_MIN;
+    stats->edges = used;
+}
+
+int CorrelationGraph::compact(uint64_t budget, CompactionStats *stats)
+{
+    if (!compacting)
+        return 1;
+
+    CompactionStats before = *stats;
+    compact_undo.clear();
+
+    struct timeval begin, now;
+    gettimeofday(&begin, 0);
+
+    typedef std::map<int, vector<int> >::iterator NeighbourIter;
+    NeighbourIter i = neighbours.lower_bound(compact_cursor);
+
+    try {
+        AutoTransaction a;
+
+        for (bool first = true; i != neighbours.end(); ++i, first = false)
+        {
+            // Always make some progress
+            if (budget && !first)
+            {
+                gettimeofday(&now, 0);
+                if (usec_diff(begin, now) > budget)
+                    break;
+            }
+
+            compact_node(i->first, stats);
+        }
+
+        a.commit();
+    }
+    catch (SQLException &e) {
+        cerr << __FILE__ << ":" << __func__ << ": " << e.what() << endl;
+
+        // The slice was rolled back, so put its edges back the way they
+        // were, dirty ones included, and leave the cursor where it was
+        for (vector<Slot>::reverse_iterator u = compact_undo.rbegin();
+                u != compact_undo.rend(); ++u)
+        {
+            Slot &slot = insert(u->key, u->weight);
+            slot.weight = u->weight;
+            slot.dirty = u->dirty;
+            stale_top(u->key >> 32);
+            stale_top(u->key & 0xFFFFFFFF);
+        }
+        compact_undo.clear();
+        *stats = before;
+        return -1;
+    }
+
+    compact_undo.clear();
+
+    if (i != neighbours.end())
+    {
+        compact_cursor = i->first;
+        return 0;
+    }
+
+    compacting = false;
+    return 1;
+}
+
+// Decays and prunes the edges from sid to higher sids, which no other node
+// covers. The edges to lower sids were done along with those nodes, so all
+// of them are up to date by the time the degree of sid is capped.
+void CorrelationGraph::compact_node(int sid, CompactionStats *stats)
+{
+    vector<int> others = neighbours[sid];
+
+    if (compact_decay != 1)
+    {
+        Q q("UPDATE C.Correlations SET weight = weight * ? WHERE x = ?;");
+        q << compact_decay << sid;
+        q.execute();
+    }
+
+    {
+        Q q("DELETE FROM C.Correlations WHERE x = ? AND abs(weight) < ?;");
+        q << sid << compact_threshold;
+        q.execute();
+    }
+
+    for (unsigned j = 0; j < others.size(); ++j)
+    {
+        if (others[j] < sid)
+            continue;
+
+        uint64_t key = make_key(sid, others[j]);
+        Slot &slot = find(key);
+        compact_undo.push_back(slot);
+        slot.weight *= compact_decay;
+        stale_top(sid);
+        stale_top(others[j]);
+        if (fabs(slot.weight) >= compact_threshold)
+            continue;
+
+        // The database only dropped the row if it was weak there too
+        if (slot.dirty)
+        {
+            Q q("DELETE FROM C.Correlations WHERE x = ? AND y = ?;");
+            q << sid << others[j];
+            q.execute();
+        }
+
+        erase(key);
+        ++stats->pruned;
+    }
+
+    const vector<int> &remaining = neighbours[sid];
+    if ((int)remaining.size() <= compact_degree)
+        return;
+
+    vector<RankedEdge> edges;
+    for (unsigned j = 0; j < remaining.size(); ++j)
+    {
+        uint64_t key = make_key(sid, remaining[j]);
+        edges.push_back(RankedEdge(fabs(find(key).weight), key));
+    }
+
+    std::nth_element(edges.begin(), edges.begin() + compact_degree,
+            edges.end(), stronger);
+    for (unsigned j = compact_degree; j < edges.size(); ++j)
+    {
+        uint64_t key = edges[j].second;
+        Q q("DELETE FROM C.Correlations WHERE x = ? AND y = ?;");
+        q << int(key >> 32) << int(key & 0xFFFFFFFF);
+        q.execute();
+
+        compact_undo.push_back(find(key));
+        erase(key);
+        ++stats->capped;
+    }
+}
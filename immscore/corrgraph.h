@@ -0,0 +1,134 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __CORRGRAPH_H
+#define __CORRGRAPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+#include <utility>
+
+// Length of the per song lists of strongest neighbours
+#define TOP_NEIGHBOURS  64
+
+struct CorrelationEdge
+{
+    int x, y;           // x < y
+    float weight;
+};
+
+struct CompactionStats
+{
+    CompactionStats() : edges(0), pruned(0), capped(0), bytes_freed(0) {}
+    int edges;          // before compaction
+    int pruned, capped;
+    long bytes_freed;
+};
+
+// In memory copy of C.Correlations. Edges are kept in an open addressed
+// hash table keyed on the (min, max) sid pair, with a list of neighbours
+// for every node. Changes are written back in batches by flush().
+class CorrelationGraph
+{
+public:
+    CorrelationGraph();
+
+    float get(int sid1, int sid2);
+
+    // Adds delta to the weight of the edge, creating it if needed, and
+    // clamps the result to [-limit, limit]. Returns the new weight.
+    float add(int sid1, int sid2, float delta, float limit);
+
+    // Appends all edges incident on sid.
+    void get_edges(int sid, std::vector<CorrelationEdge> &out);
+
+    // Appends the sids with the strongest positive correlation to sid,
+    // strongest first.
+    void get_top(int sid, std::vector<int> &out);
+    // The same for all of them, not just the first TOP_NEIGHBOURS, and
+    // without the help of the cached lists.
+    void get_ranked(int sid, std::vector<int> &out);
+
+    // Writes the modified edges to the database in one transaction.
+    void flush();
+    bool is_dirty() const { return !dirty.empty(); }
+
+    // Starts a pass that scales every weight by decay, then drops the
+    // edges weaker than threshold and the weakest edges of nodes with more
+    // than max_degree neighbours, both here and in the database.
+    void begin_compaction(float decay, float threshold, int max_degree,
+            CompactionStats *stats);
+    // Works through the pass a node at a time in sid order, stopping once
+    // budget usecs have passed if given. Returns 1 once the pass is done
+    // and 0 if work is left. Returns -1 if the database refused a slice,
+    // which is then undone here too, to be retried on the next call.
+    int compact(uint64_t budget, CompactionStats *stats);
+    bool is_compacting() const { return compacting; }
+
+private:
+    struct Slot
+    {
+        uint64_t key;   // 0 marks an empty slot
+        float weight;
+        bool dirty;
+    };
+
+    typedef std::pair<float, int> Neighbour;
+
+    // Materialized once asked for, then maintained as edges change. A
+    // list that can no longer be fixed up in place is rebuilt on demand.
+    struct TopList
+    {
+        TopList() : stale(true) {}
+        bool stale;
+        std::vector<Neighbour> entries;     // strongest first
+    };
+
+    static uint64_t make_key(int sid1, int sid2);
+    void update_top(int sid, int other, float weight);
+    void stale_top(int sid);
+    void rebuild_top(int sid, TopList &list);
+    Slot &find(uint64_t key);
+    Slot &insert(uint64_t key, float weight);
+    void erase(uint64_t key);
+    void grow();
+    void compact_node(int sid, CompactionStats *stats);
+    void load();
+    void reset();
+
+    bool loaded;
+    int bits;
+    size_t used;
+    std::vector<Slot> slots;
+    std::map<int, std::vector<int> > neighbours;
+    std::vector<uint64_t> dirty;
+    std::map<int, TopList> top;
+
+    // The compaction pass in progress, which has done the nodes before
+    // compact_cursor, and the edges the current slice changed as they were
+    // before it
+    bool compacting;
+    float compact_decay, compact_threshold;
+    int compact_degree, compact_cursor;
+    std::vector<Slot> compact_undo;
+};
+
+#endif
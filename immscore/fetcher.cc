@@ -30,16 +30,27 @@
 using std::endl;
 using std::cerr;
 
-InfoFetcher::SongData::SongData(int _position, const string &_path)
-    : Song(_path), rating(0), position(_position),
+InfoFetcher::SongData::SongData(int _position, const string &_path,
+        int _uid, int _sid)
+    : Song(_path, _uid, _sid), rating(0), position(_position),
       relation(0), acoustic(0),
-      last_played(0), identified(false) {
+      last_played(0), identified(false), analyzed(true) {
 }
 
-bool InfoFetcher::SongData::get_song_from_playlist()
+bool InfoFetcher::SongData::get_song_from_playlist(const PlaylistTable &table)
 {
-    *static_cast<Song*>(this) = PlaylistDb::playlist_id_from_item(position);
-    return isok();
+    if (table.has(position) && table.uid[position] >= 0)
+    {
+        uid = table.uid[position];
+        sid = table.sid[position];
+        return isok();
+    }
+
+    Song song = PlaylistDb::playlist_id_from_item(position);
+    if (!song.isok())
+        return false;
+    *static_cast<Song*>(this) = song;
+    return true;
 }
 
 bool InfoFetcher::identify_playlist_item(int pos)
@@ -58,12 +69,19 @@ bool InfoFetcher::fetch_song_info(SongData &data)
     if (access(data.get_path().c_str(), R_OK))
         return false;
 
+    return load_song_info(data);
+}
+
+bool InfoFetcher::load_song_info(SongData &data)
+{
+    PlaylistTable &table = PlaylistDb::table;
+
     AutoTransaction at;
-    if (!data.get_song_from_playlist())
+    if (!data.get_song_from_playlist(table))
     {
         if (!identify_playlist_item(data.position))
             return false;
-        data.get_song_from_playlist();
+        data.get_song_from_playlist(table);
     }
     at.commit();
 
@@ -72,25 +90,55 @@ bool InfoFetcher::fetch_song_info(SongData &data)
         return false;
     }
 
-    StringPair info = data.get_info();
+    // Only go to the database for what the playlist table doesn't know
+    int pos = data.position;
+    bool cached = table.has(pos) && table.uid[pos] == data.get_uid();
 
-    const string &artist = info.first;
-    const string &title = info.second;
-
-    if (artist != "" && title != "")
+    if (cached && table.identified[pos])
         data.identified = true;
-    else if ((data.identified = parse_song_info(data, info)))
-        data.set_info(info);
+    else
+    {
+        StringPair info = data.get_info();
+
+        const string &artist = info.first;
+        const string &title = info.second;
 
-    data.rating = data.get_rating();
+        if (artist != "" && title != "")
+            data.identified = true;
+        else if ((data.identified = parse_song_info(data, info)))
+            data.set_info(info);
 
 #if defined(DEBUG) && 0
-    cerr << "path:\t" << data.get_path() << endl;
-    cerr << "artist:\t" << artist << endl;
-    cerr << "title:\t" << title << endl;
+        cerr << "path:\t" << data.get_path() << endl;
+        cerr << "artist:\t" << artist << endl;
+        cerr << "title:\t" << title << endl;
 #endif
+    }
+
+    if (cached && table.rating[pos] >= 0)
+        data.rating = table.rating[pos];
+    else
+        data.rating = data.get_rating();
 
-    data.last_played = time(0) - data.get_last();
+    time_t last;
+    if (cached && table.sid[pos] == data.get_sid())
+        last = table.last[pos];
+    else
+        last = data.get_last();
+
+    data.last_played = time(0) - last;
+
+    if (cached)
+    {
+        // Songs get analyzed in the background after the table is loaded
+        if (!table.analyzed[pos])
+            table.analyzed[pos] = data.isanalyzed();
+        data.analyzed = table.analyzed[pos];
+        table.sid[pos] = data.get_sid();
+        table.rating[pos] = data.rating;
+        table.last[pos] = last;
+        table.identified[pos] = data.identified;
+    }
 
     return true;
 }
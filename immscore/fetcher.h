@@ -31,20 +31,23 @@ protected:
     class SongData : public Song
     {
      public:
-       SongData(int _position, const string &_path);
+       SongData(int _position, const string &_path,
+               int _uid = -1, int _sid = -1);
        bool operator ==(const SongData &other) const
        { return position == other.position; }
 
-       bool get_song_from_playlist();
+       bool get_song_from_playlist(const PlaylistTable &table);
 
        int rating;
        int position;
        int relation, acoustic;
        time_t last_played;
-       bool identified;
+       bool identified, analyzed;
     };
 
     virtual bool fetch_song_info(SongData &data);
+    // Same as fetch_song_info(), but assumes the file is known to exist
+    bool load_song_info(SongData &data);
     virtual bool parse_song_info(const SongData &data, StringPair &info);
 
     bool identify_playlist_item(int pos);
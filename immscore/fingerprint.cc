@@ -0,0 +1,153 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "fingerprint.h"
+
+#define WINDOW      (256 * 4096)
+#define TAGSIZE     128
+#define SEED        0x494d4d53
+
+// MurmurHash3_x64_128 by Austin Appleby, which was placed in the public
+// domain. Blocks are read in host byte order, so fingerprints are only
+// comparable between machines of the same endianness.
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void murmur3_128(const unsigned char *data, size_t len,
+        uint32_t seed, uint64_t out[2])
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed, h2 = seed;
+
+    size_t nblocks = len / 16;
+    for (size_t i = 0; i < nblocks; ++i)
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = data + nblocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    switch (len & 15)
+    {
+        case 15: k2 ^= (uint64_t)tail[14] << 48;
+        case 14: k2 ^= (uint64_t)tail[13] << 40;
+        case 13: k2 ^= (uint64_t)tail[12] << 32;
+        case 12: k2 ^= (uint64_t)tail[11] << 24;
+        case 11: k2 ^= (uint64_t)tail[10] << 16;
+        case 10: k2 ^= (uint64_t)tail[9] << 8;
+        case  9: k2 ^= (uint64_t)tail[8];
+                 k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        case  8: k1 ^= (uint64_t)tail[7] << 56;
+        case  7: k1 ^= (uint64_t)tail[6] << 48;
+        case  6: k1 ^= (uint64_t)tail[5] << 40;
+        case  5: k1 ^= (uint64_t)tail[4] << 32;
+        case  4: k1 ^= (uint64_t)tail[3] << 24;
+        case  3: k1 ^= (uint64_t)tail[2] << 16;
+        case  2: k1 ^= (uint64_t)tail[1] << 8;
+        case  1: k1 ^= (uint64_t)tail[0];
+                 k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    out[0] = h1;
+    out[1] = h2;
+}
+
+string Fingerprint::fingerprint_file(const string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return "bad_checksum";
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf))
+    {
+        close(fd);
+        return "bad_checksum";
+    }
+
+    // Read the window and the space for a trailing tag in one go
+    off_t offset = statbuf.st_size - (WINDOW + TAGSIZE);
+    if (offset < 0)
+        offset = 0;
+    std::vector<unsigned char> buf(statbuf.st_size - offset + 1);
+
+    ssize_t n = pread(fd, &buf[0], buf.size() - 1, offset);
+    close(fd);
+    if (n < 0 || n != (ssize_t)(buf.size() - 1))
+        return "bad_checksum";
+
+    size_t len = n;
+    if (len >= TAGSIZE && !memcmp(&buf[len - TAGSIZE], "TAG", 3))
+        len -= TAGSIZE;
+    size_t start = len > WINDOW ? len - WINDOW : 0;
+
+    uint64_t hash[2];
+    murmur3_128(&buf[start], len - start, SEED, hash);
+
+    char hex_buf[40];
+    sprintf(hex_buf, FINGERPRINT_PREFIX "%016llx%016llx",
+            (unsigned long long)hash[0], (unsigned long long)hash[1]);
+    return hex_buf;
+}
+
+bool Fingerprint::is_current(const string &checksum)
+{
+    return !checksum.compare(0, strlen(FINGERPRINT_PREFIX),
+            FINGERPRINT_PREFIX);
+}
+
+bool Fingerprint::is_legacy(const string &checksum)
+{
+    return checksum != "" && checksum != "bad_checksum"
+        && checksum < FINGERPRINT_PREFIX;
+}
@@ -0,0 +1,43 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __FINGERPRINT_H
+#define __FINGERPRINT_H
+
+#include <string>
+
+using std::string;
+
+// Versioned content checksums, as stored in Identify.checksum. Older
+// databases hold bare hex MD5 digests from Md5Digest, which are replaced
+// as the files they belong to are identified again.
+#define FINGERPRINT_PREFIX  "v2:"
+
+class Fingerprint
+{
+public:
+    // Hashes up to the last megabyte of the file, not counting an ID3v1
+    // tag, with MurmurHash3. Reentrant, and reads the file with a single
+    // pread(). Returns "bad_checksum" if the file can't be read.
+    static string fingerprint_file(const string &filename);
+    static bool is_current(const string &checksum);
+    // A bare MD5 digest, which sorts before FINGERPRINT_PREFIX
+    static bool is_legacy(const string &checksum);
+};
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <algorithm>
+
+#include "framing.h"
+
+void FrameWriter::add_varint(unsigned value)
+{
+    while (value >= 0x80)
+    {
+        frame += (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    frame += (char)value;
+}
+
+void FrameWriter::add(int pos, const string &path)
+{
+    size_t shared = 0, limit = std::min(path.size(), last.size());
+    while (shared < limit && path[shared] == last[shared])
+        ++shared;
+
+    add_varint(pos);
+    add_varint(shared);
+    add_varint(path.size() - shared);
+    frame.append(path, shared, string::npos);
+    last = path;
+}
+
+bool FrameReader::read_varint(unsigned &value)
+{
+    value = 0;
+    for (int shift = 0; offset < frame.size() && shift < 32; shift += 7)
+    {
+        unsigned char c = frame[offset++];
+        value |= (unsigned)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool FrameReader::next(int &pos, string &path)
+{
+    unsigned position, shared, rest;
+    if (!read_varint(position) || !read_varint(shared)
+            || !read_varint(rest))
+        return false;
+
+    if (shared > last.size() || rest > frame.size() - offset)
+        return false;
+
+    last.erase(shared);
+    last.append(frame, offset, rest);
+    offset += rest;
+
+    pos = position;
+    path = last;
+    return true;
+}
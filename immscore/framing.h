@@ -0,0 +1,64 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __FRAMING_H
+#define __FRAMING_H
+
+#include <string>
+
+using std::string;
+
+// Largest frame either side will send or accept
+#define MAX_FRAME_SIZE  (64 * 1024)
+
+// Payload of the binary playlist frames of protocol version 3. Each entry
+// is a varint position and a path. Since playlists tend to be sorted by
+// directory, a path is stored as the length of the prefix it shares with
+// the previous one, followed by the varint length and bytes of the rest.
+class FrameWriter
+{
+public:
+    void add(int pos, const string &path);
+    const string &data() const { return frame; }
+    size_t size() const { return frame.size(); }
+    // Whether adding path keeps the frame within MAX_FRAME_SIZE. Each entry
+    // has three varints of at most 5 bytes on top of the path.
+    bool fits(const string &path) const
+        { return frame.size() + path.size() + 15 <= MAX_FRAME_SIZE; }
+    void clear() { frame = last = ""; }
+private:
+    void add_varint(unsigned value);
+
+    string frame, last;
+};
+
+class FrameReader
+{
+public:
+    FrameReader(const string &frame) : frame(frame), offset(0) {}
+    // Returns false at the end of the frame, or if it is malformed.
+    bool next(int &pos, string &path);
+private:
+    bool read_varint(unsigned &value);
+
+    const string &frame;
+    size_t offset;
+    string last;
+};
+
+#endif
@@ -24,13 +24,18 @@
 #include <string>
 #include <list>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
 
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "immsconf.h"
+#include "framing.h"
 
 using std::string;
 
@@ -38,13 +43,16 @@ class LineProcessor
 {
 public:
     virtual void process_line(const string &line) = 0;
+    // Binary payload sent with GIOSocket::write_frame()
+    virtual void process_frame(const string &frame) {}
     virtual ~LineProcessor() {}
 };
 
 class GIOSocket : public LineProcessor
 {
 public:
-    GIOSocket() : con(0), read_tag(0), write_tag(0), outp(0) {}
+    GIOSocket() : con(0), read_tag(0), write_tag(0), outp(0), outend(0),
+                  frame_left(0) {}
     virtual ~GIOSocket() { close(); }
 
     bool isok() { return con; }
@@ -67,6 +75,15 @@ public:
         outbuf.push_back(line);
     }
 
+    // Sent as a "Frame <size>" line followed by the raw bytes
+    void write_frame(const string &frame)
+    {
+        std::ostringstream header;
+        header << "Frame " << frame.size() << "\n";
+        write(header.str());
+        write(frame);
+    }
+
     void close()
     {
         if (con)
@@ -79,7 +96,8 @@ public:
         if (read_tag)
             g_source_remove(read_tag);
         write_tag = read_tag = 0;
-        inbuf = "";
+        inbuf = frame = "";
+        frame_left = 0;
         outbuf.clear();
         outp = 0;
         con = 0;
@@ -109,12 +127,16 @@ public:
         assert(condition & G_IO_OUT);
 
         if (!outp && !outbuf.empty())
-            outp = outbuf.front().c_str();
+        {
+            outp = outbuf.front().data();
+            outend = outp + outbuf.front().size();
+        }
 
         if (!outp)
             return (write_tag = 0);
 
-        unsigned len = strlen(outp);
+        // Frames may have NULs in them
+        unsigned len = outend - outp;
         gsize n = 0;
         GIOError e = g_io_channel_write(con, (char*)outp, len, &n);
         if (e == G_IO_ERROR_NONE)
@@ -149,33 +171,75 @@ public:
         if (condition & G_IO_IN)
         {
             gsize n = 0;
-            GIOError e = g_io_channel_read(con, buf, sizeof(buf) - 1, &n);
-            if (e == G_IO_ERROR_NONE)
+            GIOError e = g_io_channel_read(con, buf, sizeof(buf), &n);
+            // The connection may have been dropped, and this deleted
+            if (e == G_IO_ERROR_NONE && !consume(buf, n))
+                return false;
+        }
+
+        return true;
+    }
+
+    // Returns false if the peer sent garbage and the connection was closed
+    bool consume(const char *data, size_t n)
+    {
+        while (n)
+        {
+            if (frame_left)
             {
-                buf[n] = '\0';
-                char *lineend, *cur = buf;
-                while ((lineend = strchr(cur, '\n')))
+                size_t take = std::min(n, frame_left);
+                frame.append(data, take);
+                data += take;
+                n -= take;
+                if (!(frame_left -= take))
                 {
-                    *lineend = '\0';
-                    inbuf += cur;
-                    cur = lineend + 1;
-                    process_line(inbuf);
-                    inbuf = "";
+                    string payload;
+                    payload.swap(frame);
+                    process_frame(payload);
                 }
-                inbuf += cur;
+                continue;
             }
-        }
 
+            const char *lineend = (const char*)memchr(data, '\n', n);
+            if (!lineend)
+            {
+                inbuf.append(data, n);
+                return true;
+            }
+            inbuf.append(data, lineend - data);
+            n -= lineend + 1 - data;
+            data = lineend + 1;
+
+            string line;
+            line.swap(inbuf);
+            if (!line.compare(0, 6, "Frame "))
+            {
+                const char *size = line.c_str() + 6;
+                char *end = 0;
+                unsigned long len = strtoul(size, &end, 10);
+                if (!isdigit(*size) || *end || len > MAX_FRAME_SIZE)
+                {
+                    close();
+                    connection_lost();
+                    return false;
+                }
+                if (!(frame_left = len))
+                    process_frame("");
+                continue;
+            }
+            process_line(line);
+        }
         return true;
     }
 
 private:
-    char buf[128];
+    char buf[4096];
 
     GIOChannel *con;
     int read_tag, write_tag;
-    string inbuf;
-    const char *outp;
+    string inbuf, frame;
+    const char *outp, *outend;
+    size_t frame_left;
     std::list<string> outbuf;
 };
 
@@ -36,6 +36,7 @@ using std::endl;
 using std::cerr;
 using std::setprecision;
 using std::ofstream;
+using std::vector;
 
 //////////////////////////////////////////////
 // Constants
@@ -71,6 +72,7 @@ Imms::Imms(IMMSServer *server) : server(server)
 
 Imms::~Imms()
 {
+    stop_prefetch();
     clear_recent();
 }
 
@@ -122,6 +124,60 @@ void Imms::playlist_changed(int length)
     SongPicker::playlist_changed(length);
 } 
 
+bool Imms::playlist_matches(int pos, int count, int oldlength,
+        unsigned hash)
+{
+    return oldlength == pl_length && pos >= 0 && count >= 0
+        && pos + count <= oldlength
+        && PlaylistDb::get_real_playlist_length() == oldlength
+        && PlaylistDb::playlist_range_matches(pos, count, hash);
+}
+
+bool Imms::playlist_splice(int pos, int removed, const vector<string> &paths,
+        int oldlength, unsigned hash)
+{
+    if (!playlist_matches(pos, removed, oldlength, hash))
+        return false;
+
+    PlaylistDb::playlist_splice(pos, removed, paths);
+
+    int shift = paths.size() - removed;
+    if (current.position >= pos + removed)
+        current.position += shift;
+    else if (current.position >= pos)
+        current.position = -1;
+
+    playlist_shifted(oldlength + shift);
+    return true;
+}
+
+bool Imms::playlist_move(int pos, int count, int by, int oldlength,
+        unsigned hash)
+{
+    if (by <= 0 || by >= count
+            || !playlist_matches(pos, count, oldlength, hash))
+        return false;
+
+    PlaylistDb::playlist_rotate(pos, count, by);
+
+    if (current.position >= pos && current.position < pos + count)
+        current.position = pos + (current.position - pos + count - by) % count;
+
+    playlist_shifted(oldlength);
+    return true;
+}
+
+void Imms::playlist_shifted(int length)
+{
+    // Like playlist_changed(), but what is known about the items that
+    // are still there, and the recent history, is kept
+    pl_length = length;
+    local_max = std::min(MAX_TIME, pl_length * 8 * 60);
+
+    SongPicker::playlist_changed(length);
+    playlist_ready();
+}
+
 void Imms::playlist_ready()
 {
     PlaylistDb::playlist_ready();
@@ -136,6 +192,7 @@ void Imms::sync(bool incharge)
     SongPicker::reset();
     local_max = std::min(MAX_TIME,
             ImmsDb::get_effective_playlist_length() * 8 * 60);
+    SongPicker::load_weights();
     reset_selection();
 }
 
@@ -154,7 +211,9 @@ void Imms::start_song(int position, string path)
     try {
         AutoTransaction at;
 
-        current.set_last(time(0));
+        time_t now = time(0);
+        current.set_last(now);
+        PlaylistDb::table.set_last(position, current.get_sid(), now);
 
         print_song_info();
 
@@ -215,7 +274,8 @@ void Imms::set_lastinfo(LastInfo &last)
     last.set_on = time(0);
     last.uid = current.get_uid();
     last.sid = current.get_sid();
-    last.avalid = current.get_acoustic(&last.mm, last.beats);
+    last.acoustic.load(current);
+    SongPicker::transitions_changed();
 }
 
 void Imms::end_song(bool at_the_end, bool jumped, bool bad)
@@ -262,12 +322,20 @@ void Imms::end_song(bool at_the_end, bool jumped, bool bad)
     AutoTransaction at;
 
     ImmsDb::add_recent(current.get_uid(), played, flags);
-    int r = current.update_rating();
-    current.set_last(time(0));
+    int r = current.update_rating(played, flags);
+    time_t now = time(0);
+    current.set_last(now);
     current.increment_playcounter();
 
     at.commit();
 
+    PlaylistDb::table.set_rating(current.position, r);
+    PlaylistDb::table.set_last(current.position, current.get_sid(), now);
+
+    current.rating = r;
+    current.last_played = 0;
+    SongPicker::update_weight(current);
+
     fout << (jumped ? "[Jumped] " : "");
     fout << (!jumped && last_skipped ? "[Skipped] " : "");
     fout << "[After: " << r << "]";
@@ -275,7 +343,8 @@ void Imms::end_song(bool at_the_end, bool jumped, bool bad)
 
 }
 
-void Imms::evaluate_transition(SongData &data, LastInfo &last, float weight)
+void Imms::evaluate_transition(SongData &data, LastInfo &last, float weight,
+        const AcousticFeatures &acoustic, vector<Transition> &transitions)
 {
     // Reset lasts if we had them for too long
     if (last.sid != -1 && last.set_on + LAST_EXPIRE < time(0))
@@ -288,30 +357,66 @@ void Imms::evaluate_transition(SongData &data, LastInfo &last, float weight)
                 data.get_sid(), last.sid) / MAX_CORRELATION);
     data.relation += ROUND(rel * weight * CORRELATION_IMPACT);
 
-    if (!last.avalid)
+    if (!last.acoustic.valid || !acoustic.valid)
         return;
 
-    MixtureModel mm;
-    float beats[BEATSSIZE];
-    if (!data.get_acoustic(&mm, beats))
-        return;
-
-    float score = model.evaluate(last.mm, last.beats, mm, beats);
-    data.acoustic += ROUND(score * weight * ACOUSTIC_IMPACT);
+    transitions.push_back(Transition());
+    transitions.back().from = last.acoustic;
+    transitions.back().weight = weight;
 }
 
-bool Imms::fetch_song_info(SongData &data)
+void Imms::evaluate_transitions(SongData &data, AcousticFeatures &acoustic,
+        vector<Transition> &transitions)
 {
-    if (!InfoFetcher::fetch_song_info(data))
-        return false;
-
     if (data.last_played > local_max)
         data.last_played = local_max;
 
     data.acoustic = data.relation = 0;
 
-    evaluate_transition(data, handpicked, 0.75);
-    evaluate_transition(data, last, (handpicked.sid == -1 ? 0.5 : 0.25));
+    // Load the candidate's acoustic data once for both transitions
+    if (data.analyzed && (handpicked.acoustic.valid || last.acoustic.valid))
+        acoustic.load(data);
+
+    evaluate_transition(data, handpicked, 0.75, acoustic, transitions);
+    evaluate_transition(data, last, (handpicked.sid == -1 ? 0.5 : 0.25),
+            acoustic, transitions);
+}
+
+void Imms::score_transitions(SongData &data, const AcousticFeatures &acoustic,
+        const vector<Transition> &transitions)
+{
+    for (vector<Transition>::const_iterator i = transitions.begin();
+            i != transitions.end(); ++i)
+    {
+        float score = model.evaluate(i->from, acoustic);
+        data.acoustic += ROUND(score * i->weight * ACOUSTIC_IMPACT);
+    }
+}
+
+bool Imms::fetch_candidate(Candidate &c)
+{
+    if (!InfoFetcher::load_song_info(c.data))
+        return false;
+
+    c.transitions.clear();
+    evaluate_transitions(c.data, c.features, c.transitions);
+    return true;
+}
+
+void Imms::score_candidate(Candidate &c)
+{
+    score_transitions(c.data, c.features, c.transitions);
+}
+
+bool Imms::fetch_song_info(SongData &data)
+{
+    if (!InfoFetcher::fetch_song_info(data))
+        return false;
+
+    AcousticFeatures acoustic;
+    vector<Transition> transitions;
+    evaluate_transitions(data, acoustic, transitions);
+    score_transitions(data, acoustic, transitions);
 
     return true;
 }
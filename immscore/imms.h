@@ -44,7 +44,6 @@ public:
     // Important inherited public methods
     //  SongPicker:
     //      int select_next()
-    //      bool add_candidate(int, bool)
 
     void start_song(int position, std::string path);
     void end_song(bool at_the_end, bool jumped, bool bad);
@@ -52,6 +51,14 @@ public:
     virtual void playlist_ready();
 
     void playlist_changed(int length);
+    // Apply a change the client made to the playlist, as long as our copy
+    // of it matches what the client thinks we have (see PlaylistDb). If
+    // they return false the playlist has to be reloaded instead.
+    bool playlist_splice(int pos, int removed,
+            const std::vector<std::string> &paths, int oldlength,
+            unsigned hash);
+    bool playlist_move(int pos, int count, int by, int oldlength,
+            unsigned hash);
 
     // process internal events - call this periodically
     void do_events();
@@ -65,12 +72,10 @@ public:
 
 protected:
     struct LastInfo {
-        LastInfo() : sid(-1), avalid(false) {}
+        LastInfo() : sid(-1) {}
         time_t set_on;
         int uid, sid;
-        bool avalid;
-        MixtureModel mm;
-        float beats[BEATSSIZE];
+        AcousticFeatures acoustic;
     };
 
     virtual void playlist_updated() { server->playlist_updated(); }
@@ -79,16 +84,25 @@ protected:
     virtual void request_playlist_item(int index);
     virtual void get_metacandidates(int size);
     virtual void reset_selection();
+    virtual bool fetch_candidate(Candidate &c);
+    virtual void score_candidate(Candidate &c);
 
     // Helper functions
+    bool playlist_matches(int pos, int count, int oldlength, unsigned hash);
+    void playlist_shifted(int length);
     bool fetch_song_info(SongData &data);
     void print_song_info();
     void set_lastinfo(LastInfo &last);
-    void evaluate_transition(SongData &data, LastInfo &last, float weight);
+    void evaluate_transitions(SongData &data, AcousticFeatures &acoustic,
+            std::vector<Transition> &transitions);
+    void evaluate_transition(SongData &data, LastInfo &last, float weight,
+            const AcousticFeatures &acoustic,
+            std::vector<Transition> &transitions);
+    void score_transitions(SongData &data, const AcousticFeatures &acoustic,
+            const std::vector<Transition> &transitions);
 
     // State variables
     bool last_skipped, last_jumped;
-    int local_max;
 
     std::ofstream fout;
 
@@ -20,6 +20,7 @@
 
 #include "strmanip.h"
 #include "immsdb.h"
+#include "song.h"
 
 using std::cerr;
 using std::endl;
@@ -28,6 +29,13 @@ ImmsDb::ImmsDb()
 {
     sql_schema_upgrade(0);
     sql_create_tables();
+    Song::check_legacy_checksums();
+}
+
+void ImmsDb::get_filtered_positions(const std::vector<int> &sids,
+        std::vector<int> &out)
+{
+    PlaylistDb::get_filtered_positions(sids, out);
 }
 
 void ImmsDb::sql_create_tables()
@@ -23,7 +23,7 @@
 #include "playlist.h"
 #include "correlate.h"
 
-#define SCHEMA_VERSION 14
+#define SCHEMA_VERSION 17
 
 class ImmsDb : virtual public BasicDb,
                        public PlaylistDb,
@@ -34,6 +34,8 @@ public:
 protected:
     virtual void sql_create_tables();
     virtual void sql_schema_upgrade(int from = 0);
+    virtual void get_filtered_positions(const std::vector<int> &sids,
+            std::vector<int> &out);
 };
 
 #endif
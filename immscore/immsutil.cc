@@ -28,6 +28,8 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #include <iostream>
 #include <fstream>
@@ -135,6 +137,31 @@ StackLockFile::~StackLockFile()
         unlink(name.c_str());
 }
 
+MappedFile::MappedFile(const string &filename) : data(0), size(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat statbuf;
+    if (!fstat(fd, &statbuf) && statbuf.st_size > 0)
+    {
+        void *p = mmap(0, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            data = (const char *)p;
+            size = statbuf.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data)
+        munmap((void *)data, size);
+}
+
 float rms_string_distance(const string &s1, const string &s2, int max)
 {
     if (s1 == "" || s2 == "")
@@ -164,6 +191,14 @@ string path_normalize(const string &path)
     return resolved;
 }
 
+unsigned hash_path(const string &path, unsigned hash)
+{
+    for (size_t i = 0; i < path.length(); ++i)
+        hash = (hash ^ (unsigned char)path[i]) * 16777619U;
+    // Keep "ab", "c" apart from "a", "bc"
+    return (hash ^ '\n') * 16777619U;
+}
+
 int listdir(const string &dirname, vector<string> &files)
 {
     files.clear();
@@ -75,6 +75,23 @@ private:
     string name;
 };
 
+// Read only mapping of an entire file.
+class MappedFile
+{
+public:
+    MappedFile(const string &filename);
+    ~MappedFile();
+    bool isok() { return data != 0; }
+    const char *get_data() const { return data; }
+    size_t get_size() const { return size; }
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const char *data;
+    size_t size;
+};
+
 template <typename NUM>
 class StatCollector
 {
@@ -105,6 +122,11 @@ string get_imms_root(const string &file = "");
 
 string path_normalize(const string &path);
 
+// Folds a path into an FNV-1a hash, so that immsd and the clients can
+// check that they agree on a run of playlist items.
+#define PATH_HASH_SEED 2166136261U
+unsigned hash_path(const string &path, unsigned hash = PATH_HASH_SEED);
+
 float rms_string_distance(const string &s1, const string &s2,
         int max = INT_MAX);
 int listdir(const string &dirname, vector<string> &files);
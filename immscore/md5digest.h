@@ -37,9 +37,10 @@ class Md5Digest
 public:
     static string digest_file(string filename)
     {
-        static unsigned char bin_buffer[128 / 8];
-        static char hex_buf[34] = {'\0'};
-        static char tag_buf[4] = {'\0'};
+        // Not static, so that files can be digested on several threads
+        unsigned char bin_buffer[128 / 8];
+        char hex_buf[34] = {'\0'};
+        char tag_buf[4] = {'\0'};
 
         FILE *fp = fopen(filename.c_str(), "r");
         if (!fp)
@@ -16,43 +16,87 @@
  along with this program; if not, write to the Free Software
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 */
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+
 #include <iostream>
 #include <algorithm>
 #include <map>
+#include <vector>
 
 #include <math.h>
+#include <time.h>
 
 #include "picker.h"
+#include "fingerprint.h"
 #include "strmanip.h"
 #include "immsutil.h"
 
 #define     SAMPLE_SIZE             100
-#define     MIN_SAMPLE_SIZE         35
-#define     MAX_ATTEMPTS            (SAMPLE_SIZE*2)
+#define     POOL_SIZE               10
+#define     MAX_REFRESHING          8
+#define     FETCHES_PER_TICK        5
+#define     MAX_DRAWS               20
+#define     IDENTIFY_THREADS        4
+#define     IDENTIFY_QUEUE          512
+#define     IDENTIFY_REPORT         1000
+// Files re-read per batch of the MD5 checksum migration, and how long to
+// wait before looking over the rows again if some were left
+#define     UPGRADE_BATCH           16
+#define     UPGRADE_RETRY           HOUR
 
 using std::endl;
 using std::cerr;
-using std::map;
+using std::list;
+using std::vector;
 
 static inline int get_tickets_for_rating(double r) {
     static const double exp = 1.1;
     return ROUND(pow(exp, r) * 99.0 / pow(exp, 100)) + 1;
 }
 
+SongPicker::Candidate::Candidate(SongPicker *picker, int position,
+        const string &path, bool pooled)
+    : stage(Checking), data(position, ""), path(path), pooled(pooled),
+      ok(false), tickets(0), generation(0), serial(0), picker(picker)
+{
+}
+
+void SongPicker::Candidate::run()
+{
+    if (stage == Checking)
+        ok = !access(path.c_str(), R_OK);
+    else
+        picker->score_candidate(*this);
+}
+
 SongPicker::SongPicker()
-    : current(0, "current"), pl_length(0),
-      acquired(0), winner(0, "winner")
+    : current(0, "current"), pl_length(0), local_max(0),
+      winner(0, "winner"), refreshing(0), pooling(0),
+      generation(0), serial(0), identifiers(IDENTIFY_THREADS),
+      identifying(0), identify_cursor(-1), identified(0), unidentified(0),
+      identify_started(0), upgrading(0), upgrade_live(0), upgrade_after(0)
 {
     reschedule_requested = playlist_known = 0;
     reset();
 }
 
+SongPicker::~SongPicker()
+{
+    clear_candidates();
+}
+
+void SongPicker::stop_prefetch()
+{
+    workers.stop();
+    identifiers.stop();
+}
+
 void SongPicker::reset()
 {
-    candidates.clear();
     metacandidates.clear();
-    acquired = attempts = 0;
-    selection_ready = false;
+    round_started = selection_ready = false;
     if (reschedule_requested)
         --reschedule_requested;
 }
@@ -60,44 +104,286 @@ void SongPicker::reset()
 void SongPicker::playlist_changed(int length)
 {
     playlist_known = 0;
+    sampler.clear();
+    base_weights.clear();
+    scored.clear();
+    clear_candidates();
     reset();
+
+    // Identifications still in flight are dropped by clear_candidates()
+    identify_cursor = -1;
+    identified = unidentified = 0;
+}
+
+void SongPicker::playlist_ready()
+{
+    playlist_known = 1;
+    load_weights();
+}
+
+int SongPicker::get_tickets(double rating, time_t last_played)
+{
+    // Penalize the rating linearly based on how recently this song was
+    // played compared to the longest tracked interval.
+    if (local_max > 0 && last_played < local_max)
+        rating *= (double)std::max(last_played, (time_t)0) / local_max;
+    return get_tickets_for_rating(rating);
 }
 
-bool SongPicker::add_candidate(bool urgent)
+void SongPicker::infer_playlist_ratings()
 {
-    int want = urgent ? MIN_SAMPLE_SIZE : SAMPLE_SIZE;
-    if (candidates.empty() && metacandidates.empty())
-        get_metacandidates(want);
+    PlaylistTable &table = PlaylistDb::table;
 
-    if (attempts > MAX_ATTEMPTS) return false;
-    ++attempts;
+    vector<int> uids;
+    for (int i = 0; i < table.size(); ++i)
+        if (table.uid[i] >= 0 && table.rating[i] < 0)
+            uids.push_back(table.uid[i]);
 
-    if (acquired >= want || metacandidates.empty()) return false;
+    if (uids.empty())
+        return;
 
-    int position = metacandidates.back();
-    metacandidates.pop_back();
+    std::map<int, int> ratings;
+    infer_ratings(uids, ratings);
+
+    for (int i = 0; i < table.size(); ++i)
+    {
+        std::map<int, int>::iterator r = ratings.find(table.uid[i]);
+        if (r != ratings.end())
+            table.set_rating(i, r->second);
+    }
+}
+
+void SongPicker::load_weights()
+{
+    // Not loaded yet if asked to pick before the end of the playlist
+    if (!PlaylistDb::get_playlist_table().size())
+        PlaylistDb::load_playlist_table();
+
+    infer_playlist_ratings();
+
+    const PlaylistTable &table = PlaylistDb::get_playlist_table();
+    int size = table.size();
+
+    // Songs that are not identified yet get the average rating until they
+    // are fetched by the prefetch pipeline
+    int rated = 0;
+    double sum = 0;
+    for (int i = 0; i < size; ++i)
+    {
+        if (table.eligible(i) && table.rating[i] >= 0)
+        {
+            sum += table.rating[i];
+            ++rated;
+        }
+    }
+    int unknown = rated ? ROUND(sum / rated) : 50;
+
+    sampler.resize(size);
+    base_weights.assign(size, 0);
+    scored.clear();
+
+    // Forget the candidates that are no longer in the playlist or
+    // got filtered out
+    for (vector<Candidate*>::iterator i = ready.begin(); i != ready.end(); )
+    {
+        int pos = (*i)->data.position;
+        if (table.has(pos) && table.eligible(pos))
+        {
+            ++i;
+            continue;
+        }
+        queued.erase(pos);
+        delete *i;
+        i = ready.erase(i);
+    }
+
+    time_t now = time(0);
+    for (int i = 0; i < size; ++i)
+    {
+        if (!table.eligible(i))
+            continue;
+        int rating = table.rating[i] >= 0 ? table.rating[i] : unknown;
+        int tickets = get_tickets(rating, now - table.last[i]);
+        base_weights[i] = tickets;
+        sampler.set(i, tickets);
+    }
+}
+
+void SongPicker::update_weight(const SongData &data)
+{
+    if (data.position < 0 || data.position >= sampler.size())
+        return;
+
+    int base = get_tickets(data.rating, data.last_played);
+    int tickets = get_tickets(data.rating + data.relation + data.acoustic,
+            data.last_played);
+
+    base_weights[data.position] = base;
+    if (tickets != base)
+        scored.push_back(data.position);
+    sampler.set(data.position, tickets);
+}
+
+void SongPicker::transitions_changed()
+{
+    ++generation;
+    for (vector<int>::iterator i = scored.begin(); i != scored.end(); ++i)
+        sampler.set(*i, base_weights[*i]);
+    scored.clear();
+}
+
+bool SongPicker::submit_candidate(int position, bool pooled)
+{
+    if (queued.count(position))
+        return false;
 
     string path = ImmsDb::get_item_from_playlist(position);
 
     request_playlist_item(position);
 
-    if (path == "") return false;
+    if (path == "")
+        return false;
 
-    SongData data(position, path);
+    Candidate *c = new Candidate(this, position, path, pooled);
+    c->tickets = position < sampler.size() ? sampler.get(position) : 0;
+    c->serial = serial;
 
-    // TODO(mag): dedupe during meta candidate generation?
-    if (find(candidates.begin(), candidates.end(), data) != candidates.end())
-        return true;
+    queued.insert(position);
+    ++(pooled ? pooling : refreshing);
+    workers.submit(c);
+    return true;
+}
 
-    if (fetch_song_info(data))
+void SongPicker::finish_candidate(Candidate *c)
+{
+    update_weight(c->data);
+
+    if (c->pooled)
     {
-        ++acquired;
-        candidates.push_back(data);
-        if (urgent && data.rating > 80)
-            attempts = MAX_ATTEMPTS + 1;
+        --pooling;
+        ready.push_back(c);
+        return;
     }
 
-    return true;
+    --refreshing;
+    queued.erase(c->data.position);
+    delete c;
+}
+
+void SongPicker::drop_candidate(Candidate *c)
+{
+    int position = c->data.position;
+    if (position < sampler.size())
+    {
+        base_weights[position] = 0;
+        sampler.set(position, 0);
+    }
+
+    --(c->pooled ? pooling : refreshing);
+    queued.erase(position);
+    delete c;
+}
+
+void SongPicker::clear_candidates()
+{
+    // Whatever is still with the worker will be thrown away on arrival
+    ++serial;
+
+    for (list<Candidate*>::iterator i = fetching.begin();
+            i != fetching.end(); ++i)
+        delete *i;
+    for (vector<Candidate*>::iterator i = ready.begin();
+            i != ready.end(); ++i)
+        delete *i;
+
+    fetching.clear();
+    ready.clear();
+    queued.clear();
+    refreshing = pooling = 0;
+}
+
+void SongPicker::collect_candidates()
+{
+    vector<WorkItem*> finished;
+    workers.collect(finished);
+
+    for (vector<WorkItem*>::iterator i = finished.begin();
+            i != finished.end(); ++i)
+    {
+        Candidate *c = static_cast<Candidate*>(*i);
+        if (c->serial != serial)
+            delete c;
+        else if (c->stage == Candidate::Checking && !c->ok)
+            drop_candidate(c);
+        else if (c->stage == Candidate::Checking
+                || c->generation != generation)
+            fetching.push_back(c);
+        else
+            finish_candidate(c);
+    }
+}
+
+void SongPicker::prefetch()
+{
+    collect_candidates();
+
+    for (int i = 0; i < FETCHES_PER_TICK && !fetching.empty(); ++i)
+    {
+        Candidate *c = fetching.front();
+        fetching.pop_front();
+
+        // Skip identifying the file again if the table already knows it
+        const PlaylistTable &table = PlaylistDb::get_playlist_table();
+        int pos = c->data.position;
+        if (table.has(pos) && table.uid[pos] >= 0)
+            c->data = SongData(pos, c->path, table.uid[pos], table.sid[pos]);
+        else
+            c->data = SongData(pos, c->path);
+        if (!fetch_candidate(*c))
+        {
+            drop_candidate(c);
+            continue;
+        }
+
+        c->stage = Candidate::Scoring;
+        c->generation = generation;
+        workers.submit(c);
+    }
+
+    // Rescore one pooled candidate at a time if it went stale, so that
+    // the rest of the pool stays available to select_next()
+    for (vector<Candidate*>::iterator i = ready.begin();
+            ready.size() > 1 && i != ready.end(); ++i)
+    {
+        if ((*i)->generation == generation)
+            continue;
+        ++pooling;
+        fetching.push_back(*i);
+        ready.erase(i);
+        break;
+    }
+
+    // Refresh the weights of the songs related to the last ones played
+    if (!round_started)
+    {
+        get_metacandidates(SAMPLE_SIZE);
+        round_started = true;
+    }
+    while (refreshing < MAX_REFRESHING && !metacandidates.empty())
+    {
+        submit_candidate(metacandidates.back(), false);
+        metacandidates.pop_back();
+    }
+
+    // Keep the pool topped up with draws from the whole playlist
+    for (int i = 0; i < MAX_DRAWS
+            && (int)ready.size() + pooling < POOL_SIZE; ++i)
+    {
+        int position = sampler.draw();
+        if (position < 0)
+            break;
+        submit_candidate(position, true);
+    }
 }
 
 bool SongPicker::do_events()
@@ -105,30 +391,182 @@ bool SongPicker::do_events()
     if (!playlist_known || !pl_length)
         return true;
 
-    for (int i = 0; i < 5 && !selection_ready ; ++i)
-        if (!add_candidate())
+    if (!sampler.size())
+        load_weights();
+
+    prefetch();
+
+    if (!selection_ready && metacandidates.empty() && !refreshing)
+    {
+        selection_ready = true;
+        if (reschedule_requested)
         {
-            selection_ready = true;
-            if (reschedule_requested)
-            {
-                reschedule_requested = 0;
-                reset_selection();
-            }
+            reschedule_requested = 0;
+            reset_selection();
         }
+    }
 
     if (playlist_known == 2)
+    {
+        upgrade_checksums();
         return false;
+    }
 
-    int pos = ImmsDb::get_unknown_playlist_item();
-    if (pos < 0)
+    if (!identify_playlist())
     {
         playlist_known = 2;
         return false;
     }
-    identify_playlist_item(pos);
     return true;
 }
 
+void SongPicker::collect_identifications()
+{
+    vector<WorkItem*> finished;
+    identifiers.collect(finished);
+    if (finished.empty())
+        return;
+
+    for (vector<WorkItem*>::iterator i = finished.begin();
+            i != finished.end(); ++i)
+    {
+        if (static_cast<Identification*>(*i)->position < 0)
+            --upgrading;
+        else
+            --identifying;
+    }
+
+    int before = identified;
+    try {
+        AutoTransaction a;
+        for (vector<WorkItem*>::iterator i = finished.begin();
+                i != finished.end(); ++i)
+        {
+            Identification *id = static_cast<Identification*>(*i);
+            // Identifying it is what swaps in the fingerprint
+            if (id->position < 0)
+            {
+                Song song(id->file);
+                continue;
+            }
+
+            if (id->serial != serial || id->file.path
+                    != PlaylistDb::get_item_from_playlist(id->position))
+                continue;
+
+            Song song(id->file);
+            PlaylistDb::playlist_update_identity(id->position,
+                    song.isok() ? song.get_uid() : -2);
+            ++identified;
+        }
+        a.commit();
+    }
+    WARNIFFAILED();
+
+    for (vector<WorkItem*>::iterator i = finished.begin();
+            i != finished.end(); ++i)
+        delete *i;
+
+    if (identified / IDENTIFY_REPORT != before / IDENTIFY_REPORT)
+        LOG(INFO) << "Identified " << identified << " of "
+            << unidentified << " playlist items" << endl;
+}
+
+void SongPicker::upgrade_checksums()
+{
+    collect_identifications();
+
+    if (!SongFile::want_legacy || upgrading || time(0) < upgrade_after)
+        return;
+
+    try {
+        Q q("SELECT path FROM Identify WHERE path > ? AND checksum < ? "
+                "AND checksum != 'bad_checksum' ORDER BY path LIMIT ?;");
+        q << upgrade_cursor << FINGERPRINT_PREFIX << UPGRADE_BATCH;
+
+        int found = 0;
+        while (q.next())
+        {
+            q >> upgrade_cursor;
+            ++found;
+
+            // Rows of files that are gone can't be identified again
+            if (access(upgrade_cursor.c_str(), R_OK))
+                continue;
+
+            identifiers.submit(
+                    new Identification(-1, upgrade_cursor, serial, false));
+            ++upgrading;
+            ++upgrade_live;
+        }
+
+        if (found)
+            return;
+
+        if (!upgrade_live)
+        {
+            LOG(INFO) << "Every file has its fingerprint" << endl;
+            Song::legacy_checksums_done();
+        }
+        else
+            upgrade_after = time(0) + UPGRADE_RETRY;
+
+        upgrade_cursor = "";
+        upgrade_live = 0;
+    }
+    WARNIFFAILED();
+}
+
+bool SongPicker::identify_playlist()
+{
+    collect_identifications();
+
+    int found = 0;
+    try {
+        if (identify_cursor < 0 && !identifying && !identified)
+        {
+            Q q("SELECT count(1) FROM Playlist WHERE uid = -1;");
+            if (q.next())
+                q >> unidentified;
+            identify_started = time(0);
+            if (unidentified > IDENTIFY_REPORT)
+                LOG(INFO) << "Identifying " << unidentified
+                    << " playlist items" << endl;
+        }
+
+        Q q("SELECT pos, path FROM Playlist WHERE uid = -1 AND pos > ? "
+                "ORDER BY pos LIMIT ?;");
+        q << identify_cursor << IDENTIFY_QUEUE - identifying;
+
+        while (q.next())
+        {
+            string path;
+            q >> identify_cursor >> path;
+            identifiers.submit(
+                    new Identification(identify_cursor, path, serial));
+            ++identifying;
+            ++found;
+        }
+    }
+    WARNIFFAILED();
+
+    if (found || identifying)
+        return true;
+
+    // Start over in case items were added behind the cursor
+    if (identify_cursor >= 0)
+    {
+        identify_cursor = -1;
+        return true;
+    }
+
+    if (identified > IDENTIFY_REPORT)
+        LOG(INFO) << "Identified " << identified << " playlist items in "
+            << time(0) - identify_started << " seconds" << endl;
+    identified = unidentified = 0;
+    return false;
+}
+
 void SongPicker::revalidate_current(int pos, const string &path)
 {
     if (winner.position == pos && winner.get_path() == path)
@@ -142,80 +580,79 @@ void SongPicker::revalidate_current(int pos, const string &path)
     }
 }
 
+SongPicker::Candidate *SongPicker::pick_candidate()
+{
+    if (ready.empty())
+        return 0;
+
+    // The pool was drawn in proportion to the tickets each song had at
+    // the time, so weigh by how much the full scoring changed them.
+    vector<double> weights(ready.size());
+    double total = 0;
+    for (size_t i = 0; i < ready.size(); ++i)
+    {
+        const SongData &data = ready[i]->data;
+        int bonus = ready[i]->generation == generation
+            ? data.relation + data.acoustic : 0;
+        int tickets = get_tickets(data.rating + bonus, data.last_played);
+        weights[i] = (double)tickets / std::max(ready[i]->tickets, 1);
+        total += weights[i];
+    }
+
+    double winning = total * imms_random(INT_MAX) / INT_MAX;
+
+    size_t i = 0;
+    for (; i < ready.size() - 1; ++i)
+        if ((winning -= weights[i]) < 0)
+            break;
+
+#ifdef DEBUG
+    cerr << " >>> picked " << ready[i]->data.position << " from a pool of "
+        << ready.size() << endl;
+#endif
+
+    Candidate *c = ready[i];
+    ready.erase(ready.begin() + i);
+    queued.erase(c->data.position);
+    return c;
+}
+
 int SongPicker::select_next()
 {
     if (PlaylistDb::get_real_playlist_length() < pl_length)
         return -1;
 
-    if (add_candidate())
-        request_reschedule();
-    if (candidates.size() < MIN_SAMPLE_SIZE)
-        while (add_candidate(true));
+    if (!sampler.size())
+        load_weights();
 
-    if (candidates.empty())
-    {
-        LOG(ERROR) << "warning: no candidates!" << endl;
-        return 0;
-    }
+    collect_candidates();
 
-    typedef map<int, vector<const SongData *> > Ratings;
-    Ratings ratings;
+    if (!selection_ready)
+        request_reschedule();
 
-    double max_last_played = 0;
-    for (Candidates::const_iterator i = candidates.begin();
-         i != candidates.end(); ++i) {
-      if (i->last_played > max_last_played)
-        max_last_played = i->last_played;
+    int position;
+    Candidate *c = pick_candidate();
+    if (c)
+    {
+        winner = c->data;
+        position = winner.position;
+        delete c;
     }
-
-    int total = 0;
-    for (Candidates::const_iterator i = candidates.begin();
-            i != candidates.end(); ++i) {
-        double effective_rating = i->rating + i->relation + i->acoustic;
-        // Penalize the rating linearly based on how recently this song was
-        // played compared to other candidates.
-        if (max_last_played)
-            effective_rating *= (i->last_played / max_last_played);
-        int tickets = get_tickets_for_rating(effective_rating);
-        vector<const SongData*>& bucket = ratings[tickets];
-        if (bucket.empty())
-            total += tickets;
-        bucket.push_back(&*i);
+    else
+    {
+        // Nothing prefetched yet, so go by the cached weights alone and
+        // let start_song() fetch the rest
+        winner = SongData(-1, "");
+        position = sampler.draw();
     }
 
-    int winning_ticket = imms_random(total);
+    reset();
 
-#ifdef DEBUG
-    cerr << string(80, '-') << endl;
-    cerr << " >>> ";
-#endif
-    for (Ratings::iterator i = ratings.begin(); i != ratings.end(); ++i)
+    if (position < 0)
     {
-#ifdef DEBUG
-        cerr << i->first << ":" << i->second.size();
-#endif
-        winning_ticket -= i->first;
-        if (winning_ticket < 0)
-        {
-#ifdef DEBUG
-            cerr << "* ";
-#endif
-            winner = *i->second[imms_random(i->second.size())];
-#ifndef DEBUG
-            break;
-        }
-#else
-            winning_ticket = INT_MAX;
-        }
-        else
-            cerr << " ";
-#endif
+        LOG(ERROR) << "warning: no candidates!" << endl;
+        return 0;
     }
-#ifdef DEBUG
-    cerr << endl;
-#endif
-
-    reset();
 
-    return winner.position;
+    return position;
 }
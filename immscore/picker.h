@@ -21,46 +21,147 @@
 
 #include <string>
 #include <list>
+#include <set>
 #include <vector>
 
 #include "immsconf.h"
 #include "fetcher.h"
+#include "sampler.h"
+#include "workqueue.h"
+
+#include <model/model.h>
 
 class SongPicker : protected InfoFetcher
 {
 public:
     SongPicker();
+    virtual ~SongPicker();
     virtual int select_next();
-    virtual void playlist_ready() { playlist_known = 1; }
+    virtual void playlist_ready();
     virtual void playlist_changed(int length);
 
     void request_reschedule() { reschedule_requested = 2; }
 
 protected:
-    bool add_candidate(bool urgent = false);
+    struct Transition
+    {
+        AcousticFeatures from;
+        float weight;
+    };
+
+    // A playlist item on its way through the prefetch pipeline. The file
+    // is checked on the worker thread, the database is read on the main
+    // thread, and the acoustic scoring is done back on the worker.
+    class Candidate : public WorkItem
+    {
+    public:
+        Candidate(SongPicker *picker, int position, const std::string &path,
+                bool pooled);
+        void run();
+
+        enum { Checking, Scoring } stage;
+        SongData data;
+        std::string path;
+        bool pooled, ok;
+        int tickets, generation, serial;
+        AcousticFeatures features;
+        std::vector<Transition> transitions;
+    private:
+        SongPicker *picker;
+    };
+
     void revalidate_current(int pos, const std::string &path);
     bool do_events();
     void reset();
+    // Waits for the worker threads. Must be called before the derived
+    // class starts going away, since the workers call back into it.
+    void stop_prefetch();
+
+    // (Re)loads the weights of every playlist item from the database.
+    void load_weights();
+    // Recomputes the weight of an item from freshly fetched info.
+    void update_weight(const SongData &data);
+    // Drops the relation and acoustic bonuses, which are only valid
+    // for the current handpicked and last songs.
+    void transitions_changed();
 
     // To be implemented in Imms
     virtual void reset_selection() = 0;
     virtual void request_playlist_item(int index) = 0;
     virtual void get_metacandidates(int size) = 0;
+    // Reads what the candidate needs from the database and sets up its
+    // transitions. Called on the main thread.
+    virtual bool fetch_candidate(Candidate &c) = 0;
+    // Scores the candidate's transitions. Called on the worker thread.
+    virtual void score_candidate(Candidate &c) = 0;
 
     SongData current;
     std::vector<int> metacandidates;
-    int pl_length;
+    int pl_length, local_max;
 
 private:
-    void get_related(int pivot_sid, int limit);
+    // A new playlist item whose file is checksummed and has its tags read
+    // on one of the identification threads. Files that are only re-read
+    // for the MD5 checksum migration have a position of -1.
+    class Identification : public WorkItem
+    {
+    public:
+        Identification(int position, const std::string &path, int serial,
+                bool legacy = SongFile::want_legacy)
+            : position(position), serial(serial), file(path, legacy) {}
+        void run() { if (file.stat()) file.read(); }
+
+        int position, serial;
+        SongFile file;
+    };
 
-    bool selection_ready;
-    int reschedule_requested;
-    int acquired, attempts, playlist_known;
+    int get_tickets(double rating, time_t last_played);
+    // Rates every identified playlist item that has no rating yet.
+    void infer_playlist_ratings();
+
+    void prefetch();
+    void collect_candidates();
+    bool submit_candidate(int position, bool pooled);
+    void finish_candidate(Candidate *c);
+    void drop_candidate(Candidate *c);
+    void clear_candidates();
+    Candidate *pick_candidate();
+    // Records the identifications that have finished.
+    void collect_identifications();
+    // Hands unknown playlist items to the identification threads and
+    // records the finished ones. Returns false once there are none left.
+    bool identify_playlist();
+    // Re-reads, a batch at a time, the files still only known by their
+    // MD5 checksum, so that identifying them swaps in their fingerprint.
+    // Once a pass over Identify finds none, MD5 is no longer computed.
+    void upgrade_checksums();
+
+    bool selection_ready, round_started;
+    int reschedule_requested, playlist_known;
     SongData winner;
 
-    typedef std::list<SongData> Candidates;
-    Candidates candidates;
+    // Tickets of every playlist position, and the same without the
+    // relation and acoustic bonuses for the positions in 'scored'.
+    WeightedSampler sampler;
+    std::vector<int> base_weights, scored;
+
+    // Candidates go from the worker to 'fetching' to the worker again,
+    // and finally into 'ready' if they were drawn for the pool.
+    WorkQueue workers;
+    std::list<Candidate*> fetching;
+    std::vector<Candidate*> ready;
+    std::set<int> queued;
+    int refreshing, pooling, generation, serial;
+
+    WorkQueue identifiers;
+    int identifying, identify_cursor, identified, unidentified;
+    time_t identify_started;
+
+    // The pass of upgrade_checksums(), which has got past upgrade_cursor
+    // and found upgrade_live rows of files that are still around
+    int upgrading, upgrade_live;
+    std::string upgrade_cursor;
+    time_t upgrade_after;
 };
 
 #endif
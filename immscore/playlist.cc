@@ -17,11 +17,14 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 */
 #include <iostream>
+#include <algorithm>
 
 #include "playlist.h"
 #include "strmanip.h"
 #include "immsutil.h" 
 
+#define PLAYLIST_BATCH  1000
+
 using std::endl;
 using std::cerr;
 
@@ -94,6 +97,11 @@ void PlaylistDb::playlist_update_identity(int pos, int uid)
         q.execute();
     }
     WARNIFFAILED();
+
+    // An unidentifiable item drops out of the pool
+    effective_length_cache = -1;
+    if (table.has(pos))
+        load_playlist_row(pos);
 }
 
 void PlaylistDb::playlist_insert_item(int pos, const string &path)
@@ -106,6 +114,135 @@ void PlaylistDb::playlist_insert_item(int pos, const string &path)
         q.execute();
     }
     WARNIFFAILED();
+
+    // Items added after the bulk load at the end of the playlist
+    if (table.size())
+        load_playlist_row(pos);
+}
+
+void PlaylistDb::playlist_queue_item(int pos, const string &path)
+{
+    queued.push_back(std::make_pair(pos, path));
+    if (queued.size() >= PLAYLIST_BATCH)
+        playlist_flush();
+}
+
+void PlaylistDb::playlist_flush()
+{
+    if (queued.empty())
+        return;
+
+    int first = queued.front().first, last = first;
+    bool written = false;
+    try {
+        AutoTransaction a;
+        for (size_t i = 0; i < queued.size(); ++i)
+        {
+            Q q("INSERT OR REPLACE INTO Playlist ('pos', 'path', 'uid') "
+                    "VALUES (?, ?, -1);");
+            q << queued[i].first << queued[i].second;
+            q.execute();
+
+            first = std::min(first, queued[i].first);
+            last = std::max(last, queued[i].first);
+        }
+
+        // Look up the whole batch at once
+        Q q("UPDATE Playlist SET uid = coalesce((SELECT uid FROM Identify I "
+                "WHERE I.path = Playlist.path), -1) "
+                "WHERE uid = -1 AND pos BETWEEN ? AND ?;");
+        q << first << last;
+        q.execute();
+
+        a.commit();
+        written = true;
+    }
+    WARNIFFAILED();
+
+    // Keep the batch to be retried on the next flush
+    if (!written)
+        return;
+
+    if (table.size())
+        for (size_t i = 0; i < queued.size(); ++i)
+            load_playlist_row(queued[i].first);
+
+    queued.clear();
+}
+
+bool PlaylistDb::playlist_range_matches(int pos, int count, unsigned hash)
+{
+    unsigned ours = PATH_HASH_SEED;
+    try {
+        Q q("SELECT path FROM Playlist WHERE pos >= ? AND pos < ? "
+                "ORDER BY pos;");
+        q << pos - 1 << pos + count + 1;
+        while (q.next())
+        {
+            string path;
+            q >> path;
+            ours = hash_path(path, ours);
+        }
+    }
+    WARNIFFAILED();
+
+    return ours == hash;
+}
+
+// Items are renumbered by going through negative positions first, so
+// that no two of them ever share one.
+static void restore_positions()
+{
+    Q("UPDATE Playlist SET pos = -1 - pos WHERE pos < 0;").execute();
+}
+
+void PlaylistDb::playlist_splice(int pos, int removed,
+        const vector<string> &paths)
+{
+    // Reloaded by the sync that follows
+    table.clear();
+    effective_length_cache = -1;
+
+    try {
+        AutoTransaction a;
+
+        Q q("DELETE FROM Playlist WHERE pos >= ? AND pos < ?;");
+        q << pos << pos + removed;
+        q.execute();
+
+        int shift = paths.size() - removed;
+        if (shift)
+        {
+            Q q("UPDATE Playlist SET pos = -1 - (pos + ?) WHERE pos >= ?;");
+            q << shift << pos + removed;
+            q.execute();
+            restore_positions();
+        }
+
+        for (size_t i = 0; i < paths.size(); ++i)
+            playlist_queue_item(pos + i, paths[i]);
+        playlist_flush();
+
+        a.commit();
+    }
+    WARNIFFAILED();
+}
+
+void PlaylistDb::playlist_rotate(int pos, int count, int by)
+{
+    table.clear();
+    effective_length_cache = -1;
+
+    try {
+        AutoTransaction a;
+        Q q("UPDATE Playlist SET pos = -1 - (? + (pos - ? + ?) % ?) "
+                "WHERE pos >= ? AND pos < ?;");
+        q << pos << pos << count - by << count << pos << pos + count;
+        q.execute();
+        restore_positions();
+        a.commit();
+    }
+    WARNIFFAILED();
 }
 
 int PlaylistDb::get_real_playlist_length()
@@ -126,6 +263,9 @@ int PlaylistDb::get_effective_playlist_length()
     if (effective_length_cache != -1)
         return effective_length_cache;
 
+    if (table.size())
+        return (effective_length_cache = table.pool_size());
+
     try {
         Q q("SELECT count(1) FROM Filter WHERE uid != -2;");
         if (q.next())
@@ -138,20 +278,141 @@ int PlaylistDb::get_effective_playlist_length()
 
 void PlaylistDb::get_random_sample(vector<int> &metacandidates, int size)
 {
-    try {
-        int total = get_effective_playlist_length();
+    if (!table.size())
+        load_playlist_table();
+    table.sample(size, metacandidates);
+}
 
-        Q q("SELECT pos FROM Filter "
-                "WHERE uid != -2 AND (abs(random()) % ?) < ?;");
-        q << total << (size + 5);
+void PlaylistDb::get_filtered_positions(const vector<int> &sids,
+        vector<int> &out)
+{
+    if (!table.size())
+        load_playlist_table();
+
+    vector<int> sorted(sids);
+    std::sort(sorted.begin(), sorted.end());
+    for (int pos = 0; pos < table.size(); ++pos)
+        if (table.filtered[pos] && table.sid[pos] != -1
+                && std::binary_search(sorted.begin(), sorted.end(),
+                    table.sid[pos]))
+            out.push_back(pos);
+}
+
+void PlaylistTable::resize(int size)
+{
+    if (!size)
+        pool.clear();
+    else
+        for (int pos = size; pos < this->size(); ++pos)
+            if (slots[pos] != -1)
+            {
+                filtered[pos] = 0;
+                update_pool(pos);
+            }
+
+    slots.resize(size, -1);
+    uid.resize(size, -1);
+    sid.resize(size, -1);
+    rating.resize(size, -1);
+    last.resize(size, 0);
+    analyzed.resize(size, 0);
+    identified.resize(size, 0);
+    filtered.resize(size, 0);
+}
+
+void PlaylistTable::set_rating(int pos, int r)
+{
+    if (has(pos))
+        rating[pos] = r;
+}
+
+void PlaylistTable::set_last(int pos, int s, time_t l)
+{
+    if (!has(pos))
+        return;
+    sid[pos] = s;
+    last[pos] = l;
+}
 
-        int result;
+void PlaylistTable::update_pool(int pos)
+{
+    bool in = slots[pos] != -1;
+    if (eligible(pos) == in)
+        return;
+
+    if (!in)
+    {
+        slots[pos] = pool.size();
+        pool.push_back(pos);
+        return;
+    }
+
+    // Move the last entry into the hole
+    int last = pool.back();
+    pool[slots[pos]] = last;
+    slots[last] = slots[pos];
+    pool.pop_back();
+    slots[pos] = -1;
+}
+
+void PlaylistTable::sample(int k, vector<int> &out)
+{
+    // Partial Fisher-Yates shuffle of the front of the pool
+    int n = pool.size();
+    k = std::min(k, n);
+    for (int i = 0; i < k; ++i)
+    {
+        int j = i + imms_random(n - i);
+        std::swap(pool[i], pool[j]);
+        slots[pool[i]] = i;
+        slots[pool[j]] = j;
+        out.push_back(pool[i]);
+    }
+}
+
+#define PLAYLIST_TABLE_QUERY \
+    "SELECT P.pos, P.uid, coalesce(L.sid, -1), coalesce(R.rating, -1), " \
+        "coalesce(T.last, 0), " \
+        "EXISTS (SELECT 1 FROM A.Acoustic WHERE uid = P.uid " \
+            "AND mfcc NOTNULL AND bpm NOTNULL), " \
+        "EXISTS (SELECT 1 FROM Info WHERE sid = L.sid), " \
+        "P.uid IN Matches OR NOT EXISTS (SELECT * FROM Matches LIMIT 1) " \
+    "FROM Playlist P LEFT JOIN Library L ON L.uid = P.uid " \
+    "LEFT JOIN Ratings R ON R.uid = P.uid " \
+    "LEFT JOIN Last T ON T.sid = L.sid "
+
+static void read_playlist_row(SQLQuery &q, PlaylistTable &table)
+{
+    int pos, analyzed, identified, filtered;
+    q >> pos;
+    if (pos >= table.size())
+        table.resize(pos + 1);
+    q >> table.uid[pos] >> table.sid[pos] >> table.rating[pos]
+        >> table.last[pos] >> analyzed >> identified >> filtered;
+    table.analyzed[pos] = analyzed;
+    table.identified[pos] = identified;
+    table.filtered[pos] = filtered;
+    table.update_pool(pos);
+}
+
+void PlaylistDb::load_playlist_table()
+{
+    table.clear();
+    try {
+        Q q(PLAYLIST_TABLE_QUERY "ORDER BY P.pos;");
         while (q.next())
-        {
-            q >> result;
-            metacandidates.push_back(result);
-        }
+            read_playlist_row(q, table);
+    }
+    WARNIFFAILED();
+}
 
+void PlaylistDb::load_playlist_row(int pos)
+{
+    try {
+        Q q(PLAYLIST_TABLE_QUERY "WHERE P.pos = ?;");
+        q << pos;
+        if (q.next())
+            read_playlist_row(q, table);
     }
     WARNIFFAILED();
 }
@@ -190,6 +451,9 @@ void PlaylistDb::playlist_clear()
         Q("DELETE FROM DiskMatches;").execute();
     }
     WARNIFFAILED();
+
+    queued.clear();
+    table.clear();
 }
 
 void PlaylistDb::sync()
@@ -205,4 +469,6 @@ void PlaylistDb::sync()
         a.commit();
     }
     WARNIFFAILED();
+
+    load_playlist_table();
 }
@@ -23,14 +23,64 @@
 #include "basicdb.h"
 #include "song.h"
 
+#include <utility>
 #include <vector>
 
+// Columnar copy of what the picker needs to know about every playlist
+// position, so that it doesn't have to go to the database for it.
+struct PlaylistTable
+{
+    void resize(int size);
+    void clear() { resize(0); }
+    int size() const { return uid.size(); }
+    bool has(int pos) const { return pos >= 0 && pos < size(); }
+    bool eligible(int pos) const { return filtered[pos] && uid[pos] != -2; }
+
+    void set_rating(int pos, int rating);
+    void set_last(int pos, int sid, time_t last);
+
+    // Re-checks whether pos belongs in the pool of eligible positions.
+    // Must be called after changing its uid or filter bit.
+    void update_pool(int pos);
+    int pool_size() const { return pool.size(); }
+    // Appends k (or all, if there are fewer) distinct eligible positions,
+    // chosen uniformly at random, in O(k).
+    void sample(int k, std::vector<int> &out);
+
+    std::vector<int> uid, sid;
+    std::vector<int> rating;                // -1 if not yet known
+    std::vector<time_t> last;
+    std::vector<char> analyzed, identified;
+    std::vector<char> filtered;             // passes the current filter
+
+private:
+    // Eligible positions in no particular order, and the index of every
+    // position in it (or -1)
+    std::vector<int> pool, slots;
+};
+
 class PlaylistDb
 {
 public:
     PlaylistDb() : effective_length_cache(-1) { clear_matches(); }
     virtual ~PlaylistDb() {};
     void playlist_insert_item(int pos, const string &path);
+    // Same as playlist_insert_item(), but the item is only buffered until
+    // playlist_flush(), which happens on its own every PLAYLIST_BATCH
+    // items and when the playlist is ready.
+    void playlist_queue_item(int pos, const string &path);
+    void playlist_flush();
+
+    // Checks a client's hash_path() of the count items at pos, plus the
+    // one on either side of them, if there is one.
+    bool playlist_range_matches(int pos, int count, unsigned hash);
+    // Replaces the removed items at pos with paths, and shifts the ones
+    // after them along. Known items keep their identity.
+    void playlist_splice(int pos, int removed,
+            const std::vector<string> &paths);
+    // Moves every item in [pos, pos + count) back by places, wrapping
+    // around within the range.
+    void playlist_rotate(int pos, int count, int by);
     void playlist_update_identity(int pos, int uid);
     static Song playlist_id_from_item(int pos);
 
@@ -40,10 +90,15 @@ public:
     int get_real_playlist_length();
     int get_effective_playlist_length();
     void get_random_sample(std::vector<int> &metacandidates, int size);
+    // Appends the positions of sids that pass the filter, in order
+    void get_filtered_positions(const std::vector<int> &sids,
+            std::vector<int> &out);
+    const PlaylistTable &get_playlist_table() const { return table; }
 
     void playlist_clear();
     void playlist_ready()
     {
+        playlist_flush();
         sync();
         playlist_updated();
     }
@@ -56,8 +111,14 @@ protected:
     virtual void sql_create_tables();
     virtual void sql_schema_upgrade(int from = 0) {}
 
+    void load_playlist_table();
+    void load_playlist_row(int pos);
+
+    PlaylistTable table;
+
 private:
     int effective_length_cache;
+    std::vector<std::pair<int, string> > queued;
 };
 
 #endif
@@ -0,0 +1,69 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include "sampler.h"
+#include "immsutil.h"
+
+void WeightedSampler::resize(int size)
+{
+    weights.assign(size, 0);
+    tree.assign(size + 1, 0);
+    total = 0;
+    for (top = 1; top <= size; top <<= 1);
+    top >>= 1;
+}
+
+void WeightedSampler::set(int index, int weight)
+{
+    if (weight < 0)
+        weight = 0;
+
+    int delta = weight - weights[index];
+    if (!delta)
+        return;
+
+    weights[index] = weight;
+    total += delta;
+
+    for (int i = index + 1; i < (int)tree.size(); i += i & -i)
+        tree[i] += delta;
+}
+
+int WeightedSampler::find(int ticket) const
+{
+    // Descend from the highest power of two, skipping every subtree
+    // whose tickets all come before the one we are looking for.
+    int pos = 0;
+    for (int step = top; step; step >>= 1)
+    {
+        int next = pos + step;
+        if (next < (int)tree.size() && tree[next] <= ticket)
+        {
+            pos = next;
+            ticket -= tree[next];
+        }
+    }
+    return pos;
+}
+
+int WeightedSampler::draw() const
+{
+    if (total <= 0)
+        return -1;
+    return find(imms_random(total));
+}
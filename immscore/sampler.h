@@ -0,0 +1,54 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+
+#include <vector>
+
+// Fenwick (binary indexed) tree over non negative integer weights.
+// Changing a weight, taking a prefix sum and drawing an index with
+// probability proportional to its weight are all O(log n).
+class WeightedSampler
+{
+public:
+    WeightedSampler() : total(0), top(0) {}
+
+    // Resizes the sampler, setting every weight to 0.
+    void resize(int size);
+    void clear() { resize(0); }
+
+    int size() const { return weights.size(); }
+    int get_total() const { return total; }
+    int get(int index) const { return weights[index]; }
+
+    void set(int index, int weight);
+
+    // Returns the index owning the given ticket, which must be in
+    // [0, get_total()).
+    int find(int ticket) const;
+
+    // Returns a random index, or -1 if all the weights are 0.
+    int draw() const;
+
+private:
+    std::vector<int> tree, weights;
+    int total, top;
+};
+
+#endif
@@ -24,11 +24,15 @@
 #include <unistd.h>
 
 #include <iostream>
+#include <map>
+#include <set>
+#include <vector>
 
 #include "analyzer/beatkeeper.h"
 #include "analyzer/mfcckeeper.h"
 
 #include "appname.h"
+#include "fingerprint.h"
 #include "flags.h"
 #include "immsutil.h"
 #include "ltqnorm.h"
@@ -41,9 +45,100 @@
 #define DELTA_SCALE     0.8
 #define DECAY_LIMIT     60
 #define MIN_TRIALS      10
+// Enough for DECAY_LIMIT / DELTA_SCALE of the smallest deltas, plus one
+#define MAX_RECENT_PLAYS    128
+#define LASTSEEN_INTERVAL   60
+#define LEGACY_MARKER       "legacy_checksums"
 
 using std::cerr;
 using std::endl;
+using std::map;
+using std::set;
+using std::vector;
+
+// Process-wide cache of paths that have been identified, so that a Song
+// for a known and unchanged file costs a stat() rather than a lookup in
+// Identify. Sids are kept per uid, since they change under all the paths
+// of a uid at once. Anything committed by another process drops it all.
+struct Identity
+{
+    int uid;
+    time_t modtime;
+    bool legacy;        // still only known by its MD5 checksum
+};
+
+static map<string, Identity> identities;
+static map<int, int> identity_sids;
+static int identities_version = -1;
+
+static set<int> seen_uids;
+static time_t seen_flushed = 0;
+
+static void validate_identities()
+{
+    int version = -1;
+    try {
+        Q q("PRAGMA data_version;");
+        if (q.next())
+            q >> version;
+    }
+    IGNOREFAILURE();
+
+    if (version == identities_version)
+        return;
+
+    identities.clear();
+    identity_sids.clear();
+    identities_version = version;
+}
+
+static void cache_sid(int uid, int sid)
+{
+    map<int, int>::iterator i = identity_sids.find(uid);
+    if (i != identity_sids.end())
+        i->second = sid;
+}
+
+static void note_seen(int uid)
+{
+    if (uid < 0)
+        return;
+
+    seen_uids.insert(uid);
+    if (time(0) - seen_flushed >= LASTSEEN_INTERVAL)
+        Song::flush_lastseen();
+}
+
+void Song::forget_identity(const string &path, bool isdir)
+{
+    if (!isdir)
+    {
+        identities.erase(path);
+        return;
+    }
+
+    // Everything between "dir/" and "dir0" is inside dir
+    identities.erase(identities.lower_bound(path + "/"),
+            identities.lower_bound(path + "0"));
+}
+
+void Song::flush_lastseen()
+{
+    seen_flushed = time(0);
+    if (seen_uids.empty())
+        return;
+
+    try {
+        AutoTransaction a(AppName != IMMSD_APP);
+        for (set<int>::iterator i = seen_uids.begin();
+                i != seen_uids.end(); ++i)
+            Q("UPDATE Library SET lastseen = ? WHERE uid = ?")
+                << seen_flushed << *i << execute;
+        a.commit();
+        seen_uids.clear();
+    }
+    WARNIFFAILED();
+}
 
 int evaluate_artist(const string &artist, const string &album,
                     const string &title, int count)
@@ -97,19 +192,57 @@ Song::Song(const string &path_, int _uid, int _sid) : path(path_)
     if (isok() || path == "")
         return;
 
-    struct stat statbuf;
-    if (stat(path.c_str(), &statbuf))
+    SongFile file(path);
+    if (!file.stat())
         return;
 
     try {
-        identify(statbuf.st_mtime);
+        identify(file);
+    }
+    WARNIFFAILED();
 
-        AutoTransaction a(AppName != IMMSD_APP);
-        Q("UPDATE Library SET lastseen = ? WHERE uid = ?")
-            << time(0) << uid << execute;
-        a.commit();
+    note_seen(uid);
+}
+
+Song::Song(const SongFile &file) : path(file.path)
+{
+    reset();
+
+    if (path == "" || !file.modtime)
+        return;
+
+    try {
+        SongFile copy(file);
+        identify(copy);
     }
     WARNIFFAILED();
+
+    note_seen(uid);
+}
+
+bool SongFile::stat()
+{
+    struct stat statbuf;
+    if (::stat(path.c_str(), &statbuf))
+        return false;
+    modtime = statbuf.st_mtime;
+    return true;
+}
+
+bool SongFile::want_legacy = true;
+
+void SongFile::read()
+{
+    checksum = Fingerprint::fingerprint_file(path);
+    if (legacy)
+        legacy_checksum = Md5Digest::digest_file(path);
+
+    SongInfo info;
+    info.link(path);
+
+    artist = info.get_artist();
+    album = info.get_album();
+    title = info.get_title();
 }
 
 void Song::get_tag_info(string &artist, string &album, string &title) const
@@ -224,10 +357,27 @@ void Song::update_tag_info(const string &artist, const string &album,
     } IGNOREFAILURE();
 }
 
-void Song::identify(time_t modtime)
+void Song::identify(SongFile &file)
 {
+    time_t modtime = file.modtime;
+
+    validate_identities();
+    map<string, Identity>::iterator cached = identities.find(path);
+    if (cached != identities.end())
+    {
+        bool upgrade = cached->second.legacy
+            && Fingerprint::is_current(file.checksum);
+        if (cached->second.modtime == modtime && !upgrade)
+        {
+            uid = cached->second.uid;
+            sid = identity_sids[uid];
+            return;
+        }
+        identities.erase(cached);
+    }
+
     try {
-        Q q("SELECT Library.uid, sid, modtime "
+        Q q("SELECT Library.uid, sid, modtime, checksum "
                 "FROM Identify NATURAL JOIN 'Library' "
                 "WHERE path = ?;");
         q << path;
@@ -235,37 +385,106 @@ void Song::identify(time_t modtime)
         if (q.next())
         {
             time_t last_modtime;
-            q >> uid >> sid >> last_modtime;
+            string checksum;
+            q >> uid >> sid >> last_modtime >> checksum;
+
+            // A file still known by its MD5 checksum gets its fingerprint,
+            // but only if a worker has already read it
+            bool legacy = Fingerprint::is_legacy(checksum);
+            bool upgrade = legacy && Fingerprint::is_current(file.checksum);
 
-            if (modtime == last_modtime)
+            if (modtime == last_modtime && !upgrade)
+            {
+                Identity &identity = identities[path];
+                identity.uid = uid;
+                identity.modtime = modtime;
+                identity.legacy = legacy;
+                identity_sids[uid] = sid;
                 return;
+            }
         }
     } WARNIFFAILED();
 
-    string checksum = Md5Digest::digest_file(path);
+    if (file.checksum == "")
+        file.read();
 
     {
         AutoTransaction a(AppName != IMMSD_APP);
-        _identify(modtime, checksum);
+        bool moved = _identify(file);
         a.commit();
+        // Only once the new sid is actually in the database
+        if (moved)
+            cache_sid(uid, -1);
     }
 
-    SongInfo info;
-    info.link(path);
-
-    string artist = info.get_artist();
-    string album = info.get_album();
-    string title = info.get_title();
-
     {
         AutoTransaction a(AppName != IMMSD_APP);
-        update_tag_info(artist, album, title);
+        update_tag_info(file.artist, file.album, file.title);
         a.commit();
     }
 }
 
-void Song::_identify(time_t modtime, const string &checksum)
+void Song::check_legacy_checksums()
+{
+    SongFile::want_legacy = true;
+
+    try {
+        {
+            Q q("SELECT 1 FROM 'Schema' WHERE description = ?;");
+            q << LEGACY_MARKER;
+            if (q.next())
+            {
+                SongFile::want_legacy = false;
+                return;
+            }
+        }
+
+        // Otherwise it is up to immsd's pass over the rows to find out
+        // whether the files they belong to are still around
+        Q q("SELECT 1 FROM Identify "
+                "WHERE checksum < ? AND checksum != 'bad_checksum' LIMIT 1;");
+        q << FINGERPRINT_PREFIX;
+        if (q.next())
+            return;
+    }
+    WARNIFFAILED();
+
+    legacy_checksums_done();
+}
+
+void Song::legacy_checksums_done()
+{
+    try {
+        Q("INSERT OR REPLACE INTO 'Schema' ('description', 'version') "
+                "VALUES (?, 0);") << LEGACY_MARKER << execute;
+        SongFile::want_legacy = false;
+    }
+    WARNIFFAILED();
+}
+
+void Song::upgrade_checksum(const SongFile &file)
+{
+    if (!Fingerprint::is_current(file.checksum)
+            || !Fingerprint::is_legacy(file.legacy_checksum))
+        return;
+
+    {
+        Q q("SELECT 1 FROM Identify WHERE checksum = ?;");
+        q << file.checksum;
+        if (q.next())
+            return;
+    }
+
+    // A copy of this file may still be known by its old MD5 checksum
+    Q("UPDATE Identify SET checksum = ? WHERE checksum = ?;")
+        << file.checksum << file.legacy_checksum << execute;
+}
+
+bool Song::_identify(const SongFile &file)
 {
+    time_t modtime = file.modtime;
+    const string &checksum = file.checksum;
+
     // old path but modtime has changed - update checksum
     if (uid != -1)
     {
@@ -273,12 +492,14 @@ void Song::_identify(time_t modtime, const string &checksum)
                 "checksum = ? WHERE path = ?;");
         q << modtime << checksum << path;
         q.execute();
-        return;
+        return false;
     }
 
     // moved or new file and path needs updating
     reset();
 
+    upgrade_checksum(file);
+
     Q q("SELECT uid, path FROM Identify WHERE checksum = ?;");
     q << checksum;
 
@@ -307,7 +528,7 @@ void Song::_identify(time_t modtime, const string &checksum)
 #ifdef DEBUG
                 cerr << "identify: moved: uid = " << uid << endl;
 #endif
-                return;
+                return true;
             }
         } while (q.next());
     }
@@ -335,6 +556,7 @@ void Song::_identify(time_t modtime, const string &checksum)
                 "('uid', 'sid', 'playcounter', 'lastseen', 'firstseen') "
                 "VALUES (?, ?, ?, ?, ?);")
             << uid << -1 << 0 << time(0) << time(0) << execute;
+    return false;
 }
 
 void Song::set_last(time_t last)
@@ -353,6 +575,7 @@ void Song::set_last(time_t last)
         q.execute();
 
         a.commit();
+        cache_sid(uid, sid);
     }
     WARNIFFAILED();
 }
@@ -456,6 +679,7 @@ void Song::set_info(const StringPair &info)
         }
 
         a.commit();
+        cache_sid(uid, sid);
     }
     WARNIFFAILED();
 
@@ -628,6 +852,137 @@ static float decay(float delta, float sum)
     return delta * log(DECAY_LIMIT + 1 - sum) / log(DECAY_LIMIT);
 }
 
+// What a song's rating is computed from: the deltas of its plays, newest
+// first, and the prior from other instances of the song or its artist.
+// decay() gives nothing to plays past DECAY_LIMIT, so only the ones in
+// front of that are kept, which is never more than MAX_RECENT_PLAYS.
+struct RatingState
+{
+    RatingState() : biasmean(0.5), biastrials(0) {}
+    vector<signed char> recent;
+    float biasmean, biastrials;
+};
+
+static void trim_recent(vector<signed char> &recent)
+{
+    double total = 0;
+    for (size_t i = 0; i < recent.size(); ++i)
+    {
+        if ((float)total > DECAY_LIMIT)
+        {
+            recent.resize(i);
+            return;
+        }
+        total += fabs(recent[i] * DELTA_SCALE);
+    }
+}
+
+static int compute_rating(const RatingState &state)
+{
+    double total = 0, ones = 0, zeros = 0;
+
+    for (size_t i = 0; i < state.recent.size(); ++i)
+    {
+        double delta = state.recent[i] * DELTA_SCALE;
+        if (delta > 0)
+            ones += decay(delta, total);
+        else
+            zeros += decay(-delta, total);
+        total += fabs(delta);
+    }
+
+    if (!ones && !zeros)
+        zeros = ones = 1;
+
+    if (total < MIN_TRIALS)
+    {
+        double biasmass = MIN_TRIALS - total;
+        ones += biasmass * state.biasmean;
+        zeros += biasmass * (1 - state.biasmean);
+    }
+
+    // Clamp off a minimum values to avoid rounding errors.
+    ones = std::max(ones, 0.0001);
+    zeros = std::max(zeros, 0.0001);
+
+    // Calculate the upper bound of the Wilson score. For details, see:
+    // http://www.evanmiller.org/how-not-to-sort-by-average-rating.html.
+    double n = ones + zeros;
+    double z = ltqnorm(0.95);
+    double phat = ones / n;
+    double r = phat + z*z/(2*n) + z * sqrt((phat*(1-phat)+z*z/(4*n))/n);
+    r /= (1+z*z/n);
+
+    return ROUND(r * 100);
+}
+
+static RatingState scan_rating_state(int uid)
+{
+    RatingState state;
+    {
+        Q q("SELECT sum(mean * trials) / sum(trials), sum(trials) "
+                "FROM Bias WHERE uid = ? GROUP BY uid;");
+        q << uid;
+
+        if (q.next() && q.not_null())
+        {
+            q >> state.biasmean >> state.biastrials;
+            state.biasmean /= 100.0;
+        }
+    }
+
+    Q q("SELECT played, flags FROM Journal WHERE uid = ? "
+            "ORDER BY time DESC;");
+    q << uid;
+
+    double total = 0;
+    while (q.next() && (float)total <= DECAY_LIMIT)
+    {
+        int flags;
+        time_t played;
+        q >> played >> flags;
+
+        // Plays that count for nothing don't need to be kept
+        int delta = Flags::deltify(played, flags);
+        if (!delta)
+            continue;
+        state.recent.push_back(delta);
+        total += fabs(delta * DELTA_SCALE);
+    }
+
+    return state;
+}
+
+static bool load_rating_state(int uid, RatingState &state)
+{
+    Q q("SELECT recent, biasmean, biastrials FROM RatingState WHERE uid = ?;");
+    q << uid;
+
+    if (!q.next())
+        return false;
+
+    signed char recent[MAX_RECENT_PLAYS];
+    size_t size = sizeof(recent);
+    q.load(recent, size);
+    q >> state.biasmean >> state.biastrials;
+    state.recent.assign(recent, recent + size);
+    return true;
+}
+
+static void store_rating_state(int uid, const RatingState &state)
+{
+    static const signed char none = 0;
+
+    Q q("INSERT OR REPLACE INTO RatingState "
+            "('uid', 'recent', 'biasmean', 'biastrials') "
+            "VALUES (?, ?, ?, ?);");
+    q << uid;
+    q.bind(state.recent.empty() ? &none : &state.recent[0],
+            state.recent.size());
+    q << state.biasmean << state.biastrials;
+    q.execute();
+}
+
 int Song::update_rating()
 {
     int rating = -1;
@@ -636,64 +991,225 @@ int Song::update_rating()
 
     try
     {
-        float biasmean = 0.5, biastrials = 0;
+        RatingState state = scan_rating_state(uid);
+        store_rating_state(uid, state);
+
+        rating = compute_rating(state);
+        set_rating(rating);
+    }
+    WARNIFFAILED();
+
+    return rating;
+}
+
+int Song::update_rating(time_t played, int flags)
+{
+    int rating = -1;
+    if (uid < 0)
+        return rating;
+
+    try
+    {
+        RatingState state;
+        if (!load_rating_state(uid, state))
+        {
+            // The Journal already has this play
+            state = scan_rating_state(uid);
+        }
+        else if (int delta = Flags::deltify(played, flags))
         {
-            Q q("SELECT sum(mean * trials) / sum(trials), sum(trials) "
-                    "FROM Bias WHERE uid = ? GROUP BY uid;");
-            q << uid;
+            state.recent.insert(state.recent.begin(), delta);
+            trim_recent(state.recent);
+        }
+        store_rating_state(uid, state);
+
+        rating = compute_rating(state);
+        set_rating(rating);
+    }
+    WARNIFFAILED();
+
+    return rating;
+}
+
+typedef std::map<int, RatingState> RatingStates;
 
-            if (q.next() && q.not_null())
+int rebuild_ratings()
+{
+    RatingStates states;
+    try
+    {
+        {
+            Q q("SELECT uid, sum(mean * trials) / sum(trials), sum(trials) "
+                    "FROM Bias GROUP BY uid;");
+            while (q.next())
             {
-                q >> biasmean >> biastrials;
-                biasmean /= 100.0;
+                if (!q.not_null())
+                    continue;
+                int uid;
+                RatingState state;
+                q >> uid >> state.biasmean >> state.biastrials;
+                state.biasmean /= 100.0;
+                states[uid] = state;
             }
         }
 
-        Q q("SELECT played, flags FROM Journal WHERE uid = ? "
-                "ORDER BY time DESC;");
-        q << uid;
-
-        double total = 0, ones = 0, zeros = 0;
+        // One pass over the Journal, each uid's plays newest first
+        vector<int> seen;
+        Q q("SELECT uid, played, flags FROM Journal ORDER BY uid, time DESC;");
 
+        int current = -1;
+        RatingState *state = 0;
+        double total = 0;
         while (q.next())
         {
-            int flags;
+            int uid, flags;
             time_t played;
-            q >> played >> flags;
-            double delta = Flags::deltify(played, flags) * DELTA_SCALE;
-            if (delta > 0)
-                ones += decay(delta, total);
-            else
-                zeros += decay(-delta, total);
-            total += fabs(delta);
+            q >> uid >> played >> flags;
+
+            if (!state || uid != current)
+            {
+                current = uid;
+                state = &states[uid];
+                seen.push_back(uid);
+                total = 0;
+            }
+
+            // Same cutoff as scan_rating_state()
+            if ((float)total > DECAY_LIMIT)
+                continue;
+            int delta = Flags::deltify(played, flags);
+            if (!delta)
+                continue;
+            state->recent.push_back(delta);
+            total += fabs(delta * DELTA_SCALE);
+        }
+
+        AutoTransaction a;
+        for (size_t i = 0; i < seen.size(); ++i)
+        {
+            const RatingState &state = states[seen[i]];
+            store_rating_state(seen[i], state);
+
+            Q q("INSERT OR REPLACE INTO Ratings "
+                    "('uid', 'rating', 'dev') VALUES (?, ?, ?);");
+            q << seen[i] << compute_rating(state) << 0;
+            q.execute();
         }
+        a.commit();
+
+        return seen.size();
+    }
+    WARNIFFAILED();
+
+    return -1;
+}
+
+void infer_ratings(const vector<int> &uids, std::map<int, int> &ratings)
+{
+    typedef std::map<int, pair<int, int> > Priors;
+    std::map<int, pair<int, int> > unrated;     // uid -> (sid, aid)
+    Priors sidpriors, aidpriors;                // id -> (mean, trials)
 
-        if (!ones && !zeros)
-            zeros = ones = 1;
+    try
+    {
+        AutoTransaction a;
 
-        if (total < MIN_TRIALS)
+        for (size_t i = 0; i < uids.size(); ++i)
         {
-            double biasmass = MIN_TRIALS - total;
-            ones += biasmass * biasmean;
-            zeros += biasmass * (1 - biasmean);
+            Q q("SELECT L.sid, coalesce(I.aid, -1) FROM Library L "
+                    "LEFT JOIN Info I ON I.sid = L.sid WHERE L.uid = ? "
+                    "AND NOT EXISTS (SELECT 1 FROM Ratings WHERE uid = ?) "
+                    "LIMIT 1;");
+            q << uids[i] << uids[i];
+            if (!q.next())
+                continue;
+            int sid, aid;
+            q >> sid >> aid;
+            unrated[uids[i]] = pair<int, int>(sid, aid);
+            sidpriors[sid] = aidpriors[aid] = pair<int, int>(-1, 0);
         }
 
-        // Clamp off a minimum values to avoid rounding errors.
-        ones = std::max(ones, 0.0001);
-        zeros = std::max(zeros, 0.0001);
+        if (unrated.empty())
+            return;
 
-        // Calculate the upper bound of the Wilson score. For details, see:
-        // http://www.evanmiller.org/how-not-to-sort-by-average-rating.html.
-        double n = ones + zeros;
-        double z = ltqnorm(0.95);
-        double phat = ones / n;
-        double r = phat + z*z/(2*n) + z * sqrt((phat*(1-phat)+z*z/(4*n))/n);
-        r /= (1+z*z/n);
+        // The same priors as infer_rating(), for every song and artist at
+        // once, taken before any of the new ratings are written
+        {
+            Q q("SELECT L.sid, avg(rating), sum(playcounter) "
+                    "FROM Library L NATURAL JOIN Ratings GROUP BY L.sid;");
+            while (q.next())
+            {
+                int sid;
+                q >> sid;
+                Priors::iterator prior = sidpriors.find(sid);
+                if (prior != sidpriors.end() && q.not_null())
+                    q >> prior->second.first >> prior->second.second;
+            }
+        }
+        {
+            Q q("SELECT aid, avg(rating), sum(playcounter)/sum(1) "
+                    "FROM Library L NATURAL JOIN Info I "
+                    "INNER JOIN Ratings R on L.uid = R.uid GROUP BY aid;");
+            while (q.next())
+            {
+                int aid;
+                q >> aid;
+                Priors::iterator prior = aidpriors.find(aid);
+                if (prior != aidpriors.end() && q.not_null())
+                    q >> prior->second.first >> prior->second.second;
+            }
+        }
 
-        rating = ROUND(r * 100);
-        set_rating(rating);
+        for (std::map<int, pair<int, int> >::iterator i = unrated.begin();
+                i != unrated.end(); ++i)
+        {
+            int uid = i->first, sid = i->second.first, aid = i->second.second;
+
+            pair<int, int> prior = sidpriors[sid];
+            if (prior.first <= 0 && aid > 0)
+                prior = aidpriors[aid];
+
+            if (sid >= 0 && prior.first > 0)
+            {
+                Q q("INSERT INTO Bias ('uid', 'mean', 'trials') "
+                        "VALUES (?, ?, ?);");
+                q << uid << prior.first << prior.second;
+                q.execute();
+            }
+
+            RatingState state = scan_rating_state(uid);
+            store_rating_state(uid, state);
+
+            int rating = compute_rating(state);
+            Q q("INSERT OR REPLACE INTO Ratings "
+                    "('uid', 'rating', 'dev') VALUES (?, ?, ?);");
+            q << uid << rating << 0;
+            q.execute();
+
+            ratings[uid] = rating;
+        }
+
+        a.commit();
     }
     WARNIFFAILED();
+}
 
-    return rating;
+bool Song::check_rating(int &stored, int &rescanned)
+{
+    stored = rescanned = -1;
+    if (uid < 0)
+        return false;
+
+    try
+    {
+        RatingState state;
+        if (!load_rating_state(uid, state))
+            return false;
+
+        stored = compute_rating(state);
+        rescanned = compute_rating(scan_rating_state(uid));
+    }
+    WARNIFFAILED();
+
+    return stored == rescanned;
 }
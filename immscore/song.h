@@ -19,8 +19,12 @@
 #ifndef __IDENTIFY_H
 #define __IDENTIFY_H
 
+#include <time.h>
+
+#include <map>
 #include <utility>
 #include <string>
+#include <vector>
 
 using std::pair;
 using std::string;
@@ -29,10 +33,36 @@ typedef pair<string, string> StringPair;
 
 class MixtureModel;
 
+// What identifying a song needs from the file itself. Neither stat() nor
+// read() goes near the database, so they can be run off the main thread.
+struct SongFile
+{
+    explicit SongFile(const string &path = "", bool legacy = want_legacy)
+        : path(path), modtime(0), legacy(legacy) {}
+
+    bool stat();
+    // Checksum and tags, and the old MD5 checksum if it is still wanted,
+    // which by default is while Song::check_legacy_checksums() says so
+    void read();
+
+    string path, checksum, legacy_checksum;
+    string artist, album, title;
+    time_t modtime;
+
+    // Set on the main thread by Song::check_legacy_checksums() and
+    // legacy_checksums_done(), and copied when a SongFile is made, so that
+    // workers never read it
+    static bool want_legacy;
+private:
+    bool legacy;
+};
+
 class Song
 {
 public:
     Song(const string &path = "", int _uid = -1, int _sid = -1);
+    // Identifies an already stat()ed and, usually, read() file
+    Song(const SongFile &file);
 
     void set_last(time_t last);
     void set_info(const StringPair &info);
@@ -56,20 +86,54 @@ public:
     void set_acoustic(const MixtureModel &mm, const float *beats);
     bool get_acoustic(MixtureModel *mm, float *beats) const;
 
+    // Rebuilds the rating from the whole Journal.
     int update_rating();
+    // Folds in a play that was just added to the Journal.
+    int update_rating(time_t played, int flags);
+    // Compares the stored rating state against a Journal scan.
+    // Returns false if they disagree or there is no stored state.
+    bool check_rating(int &stored, int &rescanned);
     void infer_rating();
 
     void reset() { playcounter = uid = sid = -1; artist = title = ""; }
+
+    // Writes out the lastseen times that constructing Songs has noted.
+    // Done every so often on its own, and when the database is closed.
+    static void flush_lastseen();
+    // Drops what is remembered about the identity of path, or of
+    // everything inside it. Needed after changing Identify paths directly,
+    // since only commits by other processes are noticed on their own.
+    static void forget_identity(const string &path, bool isdir);
+    // Whether any file may still be only known by its MD5 checksum. Once
+    // none are, a Schema marker keeps MD5 from being computed again.
+    static void check_legacy_checksums();
+    // Sets the marker, once a pass found no such file left
+    static void legacy_checksums_done();
 protected:
+    // Callers update the sid cache once their transaction commits
     void register_new_sid();
-    void identify(time_t modtime);
+    void identify(SongFile &file);
     void update_tag_info(const string &artist, const string &album,
             const string &title);
 
     int uid, sid, playcounter;
     string title, artist, path;
 private:
-    void _identify(time_t modtime, const string &checksum);
+    // Returns true if it took over the uid of a file that was moved,
+    // resetting its sid
+    bool _identify(const SongFile &file);
+    // Moves Identify rows of this file from its MD5 checksum over to
+    // the current fingerprint, so that they can still be matched.
+    void upgrade_checksum(const SongFile &file);
 };
 
+// Infers a rating for those of uids that don't have one yet, the same way
+// Song::get_rating() would, but with a few grouped queries for the whole
+// set. Fills in ratings for the uids it rated.
+void infer_ratings(const std::vector<int> &uids, std::map<int, int> &ratings);
+
+// Rebuilds every rating and rating state from a single pass over the
+// Journal, in one transaction. Returns the number of songs rated, or -1.
+int rebuild_ratings();
+
 #endif
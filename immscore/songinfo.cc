@@ -46,7 +46,7 @@ protected:
 
 string Mp3Info::get_text_frame(ID3_FrameID id)
 {
-    static char buffer[1024];
+    char buffer[1024];
     ID3_Frame *myFrame = id3tag.Find(id);
     if (myFrame)
     {
@@ -0,0 +1,124 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <iostream>
+
+#include "workqueue.h"
+#include "immsutil.h"
+
+using std::endl;
+using std::deque;
+using std::vector;
+
+WorkQueue::WorkQueue(int threads)
+    : numthreads(threads), started(false), stopping(false)
+{
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&wakeup, 0);
+}
+
+WorkQueue::~WorkQueue()
+{
+    stop();
+
+    for (deque<WorkItem*>::iterator i = pending.begin();
+            i != pending.end(); ++i)
+        delete *i;
+    for (deque<WorkItem*>::iterator i = done.begin(); i != done.end(); ++i)
+        delete *i;
+
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
+}
+
+void WorkQueue::stop()
+{
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&wakeup);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], 0);
+    threads.clear();
+    started = false;
+}
+
+void WorkQueue::submit(WorkItem *item)
+{
+    if (!started && !stopping)
+    {
+        for (int i = 0; i < numthreads; ++i)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, 0, &WorkQueue::worker, this))
+                break;
+            threads.push_back(thread);
+        }
+        started = !threads.empty();
+        if (!started)
+        {
+            // No thread to hand it to, so just do it here
+            LOG(ERROR) << "could not start a worker thread" << endl;
+            item->run();
+            done.push_back(item);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    pending.push_back(item);
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
+
+void WorkQueue::collect(vector<WorkItem*> &out)
+{
+    pthread_mutex_lock(&lock);
+    out.insert(out.end(), done.begin(), done.end());
+    done.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+void *WorkQueue::worker(void *self)
+{
+    static_cast<WorkQueue*>(self)->work();
+    return 0;
+}
+
+void WorkQueue::work()
+{
+    pthread_mutex_lock(&lock);
+    while (true)
+    {
+        while (pending.empty() && !stopping)
+            pthread_cond_wait(&wakeup, &lock);
+        if (stopping)
+            break;
+
+        WorkItem *item = pending.front();
+        pending.pop_front();
+
+        pthread_mutex_unlock(&lock);
+        item->run();
+        pthread_mutex_lock(&lock);
+
+        done.push_back(item);
+    }
+    pthread_mutex_unlock(&lock);
+}
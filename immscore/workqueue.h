@@ -0,0 +1,68 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __WORKQUEUE_H
+#define __WORKQUEUE_H
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+class WorkItem
+{
+public:
+    virtual ~WorkItem() {}
+    // Called on the worker thread. Must not touch the database.
+    virtual void run() = 0;
+};
+
+// Background threads that run submitted items. The main thread hands
+// items over with submit() and takes them back, once they have run, with
+// collect(). With a single thread items run and come back in order; with
+// more they may finish in any order. Items still queued when the
+// WorkQueue is destroyed are deleted along with it.
+class WorkQueue
+{
+public:
+    WorkQueue(int threads = 1);
+    ~WorkQueue();
+
+    void submit(WorkItem *item);
+
+    // Waits for the items being run, if any, and stops the threads.
+    // Nothing submitted after this gets run.
+    void stop();
+
+    // Appends the items that have finished running to out without
+    // blocking. The caller takes ownership of them.
+    void collect(std::vector<WorkItem*> &out);
+
+private:
+    static void *worker(void *self);
+    void work();
+
+    int numthreads;
+    std::vector<pthread_t> threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    std::deque<WorkItem*> pending, done;
+    bool started, stopping;
+};
+
+#endif
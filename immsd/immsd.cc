@@ -26,33 +26,48 @@
 #include <iostream>
 #include <sstream>
 #include <list>
+#include <vector>
 
 #include "immsd.h"
 #include "appname.h"
+#include "framing.h"
 #include "strmanip.h"
 #include "immsutil.h"
+#include "watcher.h"
 
-#define INTERFACE_VERSION "2.1"
+#define INTERFACE_VERSION "3.0"
 
 using std::cerr;
 using std::cout;
 using std::endl;
 using std::list;
 using std::stringstream;
+using std::vector;
 
 const string AppName = IMMSD_APP;
 
 // set immsd defaults. we could also store these in an immsd class
 SocketType conntype = UNIX_SOCKET;
 int portno = SocketListenerBase::default_tcp_port;
+vector<string> watch_roots;
 
 static Imms *imms;
 static list<RemoteProcessor*> remotes;
+#ifdef HAVE_SYS_INOTIFY_H
+static LibraryWatcher *watcher;
+#endif
 
 gboolean do_events(void *unused)
 {
-    if (imms)
-        imms->do_events();
+    if (!imms)
+        return TRUE;
+
+    imms->do_events();
+#ifdef HAVE_SYS_INOTIFY_H
+    // The database is only open while there is an Imms
+    if (watcher)
+        watcher->do_events();
+#endif
     return TRUE;
 }
 
@@ -125,6 +140,8 @@ void RemoteProcessor::process_line(const string &line)
 ImmsProcessor::ImmsProcessor(SocketConnection *connection)
     : connection(connection)
 {
+    splice.left = 0;
+
     if (!imms)
     {
         imms = new Imms(this);
@@ -167,6 +184,35 @@ void ImmsProcessor::check_playlist_item(int pos, const string &path)
         imms->playlist_insert_item(pos, path);
 }
 
+void ImmsProcessor::reload_playlist(int length)
+{
+    imms->playlist_changed(length);
+    write_command("GetEntirePlaylist");
+}
+
+void ImmsProcessor::finish_splice()
+{
+    if (!imms->playlist_splice(splice.pos, splice.removed, splice.paths,
+                splice.oldlength, splice.hash))
+    {
+        LOG(ERROR) << "playlist splice at " << splice.pos
+            << " did not match, reloading" << endl;
+        reload_playlist(splice.oldlength - splice.removed
+                + splice.paths.size());
+    }
+    splice.paths.clear();
+}
+
+void ImmsProcessor::process_frame(const string &frame)
+{
+    // Only ever sent in place of a run of Playlist lines
+    FrameReader reader(frame);
+    int pos;
+    string path;
+    while (reader.next(pos, path))
+        imms->playlist_queue_item(pos, path_normalize(path));
+}
+
 void ImmsProcessor::process_line(const string &line)
 {
     stringstream sstr;
@@ -175,10 +221,15 @@ void ImmsProcessor::process_line(const string &line)
     string command;
     sstr >> command;
 #if defined(DEBUG) && 1
-    if (command != "Playlist" && command != "PlaylistItem")
+    if (command != "Playlist" && command != "PlaylistItem"
+            && command != "SpliceItem")
         std::cout << "> " << line << endl;
 #endif
 
+    // Anything else may look at the playlist
+    if (command != "Playlist" && command != "SpliceItem")
+        imms->playlist_flush();
+
     if (command == "Setup")
     {
         bool use_xidle;
@@ -222,7 +273,7 @@ void ImmsProcessor::process_line(const string &line)
         string path;
         getline(sstr, path);
         path = path_normalize(path);
-        imms->playlist_insert_item(pos, path);
+        imms->playlist_queue_item(pos, path);
         return;
     }
     if (command == "PlaylistEnd")
@@ -237,8 +288,40 @@ void ImmsProcessor::process_line(const string &line)
 #ifdef DEBUG
         LOG(ERROR) << "got playlist length = " << length << endl;
 #endif
-        imms->playlist_changed(length);
-        write_command("GetEntirePlaylist");
+        reload_playlist(length);
+        return;
+    }
+    if (command == "PlaylistSplice")
+    {
+        sstr >> splice.pos >> splice.removed >> splice.left
+            >> splice.oldlength >> splice.hash;
+        splice.paths.clear();
+        if (splice.left <= 0)
+            finish_splice();
+        return;
+    }
+    if (command == "SpliceItem")
+    {
+        if (splice.left <= 0)
+            return;
+        string path;
+        getline(sstr, path);
+        splice.paths.push_back(path_normalize(path));
+        if (--splice.left == 0)
+            finish_splice();
+        return;
+    }
+    if (command == "PlaylistMove")
+    {
+        int pos, count, by, length;
+        unsigned hash;
+        sstr >> pos >> count >> by >> length >> hash;
+        if (!imms->playlist_move(pos, count, by, length, hash))
+        {
+            LOG(ERROR) << "playlist move at " << pos
+                << " did not match, reloading" << endl;
+            reload_playlist(length);
+        }
         return;
     }
     if (command == "SelectNext")
@@ -270,6 +353,7 @@ bool parse_cmd_line_args(int argc, char **argv)
     const string usage = "immsd [options]\n"
           "-h, --help      display this message\n"
           "--tcp[=portno]  use TCP port instead of file port.\n"
+          "--watch=dir     identify new and changed files in dir early.\n"
           "-v, --version   display version\n";
 
     static struct option long_options[] =
@@ -277,6 +361,7 @@ bool parse_cmd_line_args(int argc, char **argv)
         {"help",    no_argument,        NULL, 'h'},
         {"tcp",     optional_argument,  NULL, 't'},
         {"version", no_argument,        NULL, 'v'},
+        {"watch",   required_argument,  NULL, 'w'},
         {0, 0, 0, 0}
     };
 
@@ -316,6 +401,15 @@ bool parse_cmd_line_args(int argc, char **argv)
                 }
                 break;
 
+            case 'w':
+#ifdef HAVE_SYS_INOTIFY_H
+                watch_roots.push_back(optarg);
+#else
+                printf("Watching directories is not supported here; "
+                        "ignoring '%s'.\n", optarg);
+#endif
+                break;
+
             case 'v':
                 printf("immsd %s", PACKAGE_VERSION);
                 exit(0);
@@ -373,6 +467,16 @@ int main(int argc, char **argv)
     for (int i = 3; i < 255; ++i)
         close(i);
 
+#ifdef HAVE_SYS_INOTIFY_H
+    if (!watch_roots.empty())
+    {
+        watcher = new LibraryWatcher();
+        for (vector<string>::iterator i = watch_roots.begin();
+                i != watch_roots.end(); ++i)
+            watcher->add_root(*i);
+    }
+#endif
+
     // create a new GIOsocket event listener by calling the 
     // appropriate constructor
     if (conntype == TCP_SOCKET)
@@ -20,6 +20,7 @@
 #define __IMMSD_H
 
 #include <string>
+#include <vector>
 
 #include "imms.h"
 #include "socketdefines.h"
@@ -33,6 +34,8 @@ public:
     SocketConnection(int fd) : processor(0) { init(fd); }
     ~SocketConnection() { delete processor; }
     virtual void process_line(const string &line);
+    virtual void process_frame(const string &frame)
+        { if (processor) processor->process_frame(frame); }
     virtual void connection_lost() { delete this; }
 protected:
     LineProcessor *processor;
@@ -61,10 +64,22 @@ public:
         { connection->write(command + "\n"); }
     void check_playlist_item(int pos, const string &path);
     void process_line(const string &line);
+    void process_frame(const string &frame);
 
     void playlist_updated();
 protected:
+    void reload_playlist(int length);
+    void finish_splice();
+
     SocketConnection *connection;
+
+    // A PlaylistSplice waiting for its SpliceItems
+    struct Splice
+    {
+        int pos, removed, left, oldlength;
+        unsigned hash;
+        std::vector<string> paths;
+    } splice;
 };
 
 #endif
@@ -0,0 +1,449 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include "immsconf.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "immsutil.h"
+#include "sqlite++.h"
+#include "strmanip.h"
+#include "watcher.h"
+
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_FROM \
+                            | IN_MOVED_TO | IN_ONLYDIR)
+// Seconds a file has to go unchanged before it is identified
+#define WATCH_SETTLE    2
+#define WATCH_THREADS   2
+#define WATCH_QUEUE     64
+// Files per analyzer run, and how long to wait after a failed run
+#define ANALYZE_BATCH   50
+#define ANALYZE_RETRY   60
+// Runs of a batch before it is given up on
+#define ANALYZE_TRIES   3
+// Exit status of an analyzer that found another one holding the lock
+#define ANALYZER_LOCKED 249
+
+using std::endl;
+using std::map;
+using std::pair;
+using std::vector;
+
+static bool is_music(const string &path)
+{
+    static const char *extensions[] = { "mp3", "ogg", "oga", "flac", "m4a",
+        "mp4", "aac", "wma", "wav", "mpc", "ape", "wv", "opus", 0 };
+
+    string ext = string_tolower(path_get_extension(path));
+    for (const char **i = extensions; *i; ++i)
+        if (ext == *i)
+            return true;
+    return false;
+}
+
+static bool is_under(const string &path, const string &dir)
+{
+    return path.size() > dir.size() && path[dir.size()] == '/'
+        && !path.compare(0, dir.size(), dir);
+}
+
+LibraryWatcher::LibraryWatcher()
+    : fd(inotify_init()), channel(0), tag(0), identifiers(WATCH_THREADS),
+      identifying(0), analyzer(0), analyze_after(0), analyze_tries(0)
+{
+    if (fd < 0)
+    {
+        LOG(ERROR) << "could not start watching: " << strerror(errno) << endl;
+        return;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    channel = g_io_channel_unix_new(fd);
+    tag = g_io_add_watch(channel, (GIOCondition)(G_IO_IN | G_IO_PRI),
+            read_event, this);
+}
+
+LibraryWatcher::~LibraryWatcher()
+{
+    identifiers.stop();
+
+    if (tag)
+        g_source_remove(tag);
+    if (channel)
+    {
+        g_io_channel_close(channel);
+        g_io_channel_unref(channel);
+    }
+}
+
+void LibraryWatcher::add_root(const string &root)
+{
+    if (!isok())
+        return;
+
+    string dir = path_normalize(root);
+    size_t before = dirs.size();
+    watch_tree(dir, false);
+
+    LOG(INFO) << "watching " << dirs.size() - before << " directories in "
+        << dir << endl;
+}
+
+void LibraryWatcher::watch_tree(const string &dir, bool queue_files)
+{
+    int wd = inotify_add_watch(fd, dir.c_str(), WATCH_EVENTS);
+    if (wd < 0)
+    {
+        static bool warned = false;
+        if (errno == ENOSPC && !warned)
+        {
+            LOG(ERROR) << "out of inotify watches, see "
+                "/proc/sys/fs/inotify/max_user_watches" << endl;
+            warned = true;
+        }
+        return;
+    }
+    dirs[wd] = dir;
+
+    // Directories that just appeared may have been filled already
+    vector<string> files;
+    listdir(dir, files);
+    for (vector<string>::iterator i = files.begin(); i != files.end(); ++i)
+    {
+        if (*i == "." || *i == "..")
+            continue;
+
+        string path = dir + "/" + *i;
+        struct stat statbuf;
+        if (lstat(path.c_str(), &statbuf))
+            continue;
+
+        if (S_ISDIR(statbuf.st_mode))
+            watch_tree(path, queue_files);
+        else if (queue_files && S_ISREG(statbuf.st_mode))
+            changed(path);
+    }
+}
+
+void LibraryWatcher::unwatch_tree(const string &dir)
+{
+    for (map<int, string>::iterator i = dirs.begin(); i != dirs.end();)
+    {
+        if (i->second != dir && !is_under(i->second, dir))
+        {
+            ++i;
+            continue;
+        }
+        inotify_rm_watch(fd, i->first);
+        dirs.erase(i++);
+    }
+}
+
+gboolean LibraryWatcher::read_event(GIOChannel *source,
+        GIOCondition condition, gpointer data)
+{
+    ((LibraryWatcher*)data)->read_events();
+    return TRUE;
+}
+
+void LibraryWatcher::read_events()
+{
+    // Aligned for struct inotify_event
+    long buf[1024];
+
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        char *cur = (char*)buf, *end = cur + n;
+        while (cur < end)
+        {
+            struct inotify_event *event = (struct inotify_event*)cur;
+            handle_event(event);
+            cur += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    // Moves out of the watched trees never get their other half
+    for (map<uint32_t, pair<string, bool> >::iterator i = moves.begin();
+            i != moves.end(); ++i)
+        if (i->second.second)
+            unwatch_tree(i->second.first);
+    moves.clear();
+}
+
+void LibraryWatcher::handle_event(const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        LOG(ERROR) << "too many changes at once, some were missed" << endl;
+        return;
+    }
+
+    map<int, string>::iterator dir = dirs.find(event->wd);
+    if (dir == dirs.end())
+        return;
+
+    if (event->mask & IN_IGNORED)
+    {
+        dirs.erase(dir);
+        return;
+    }
+
+    if (!event->len)
+        return;
+
+    string path = dir->second + "/" + event->name;
+    bool isdir = event->mask & IN_ISDIR;
+
+    if (event->mask & IN_MOVED_FROM)
+    {
+        moves[event->cookie] = std::make_pair(path, isdir);
+        return;
+    }
+
+    if (event->mask & IN_MOVED_TO)
+    {
+        map<uint32_t, pair<string, bool> >::iterator from =
+            moves.find(event->cookie);
+        if (from != moves.end())
+        {
+            moved(from->second.first, path, isdir);
+            moves.erase(from);
+        }
+        else if (isdir)
+            watch_tree(path, true);
+        else
+            changed(path);
+        return;
+    }
+
+    if (isdir)
+    {
+        if (event->mask & IN_CREATE)
+            watch_tree(path, true);
+        return;
+    }
+
+    if (event->mask & IN_CLOSE_WRITE)
+        changed(path);
+}
+
+void LibraryWatcher::moved(const string &from, const string &to, bool isdir)
+{
+    Rename r;
+    r.from = from;
+    r.to = to;
+    r.isdir = isdir;
+    renames.push_back(r);
+
+    // Changes that haven't been identified yet move along
+    for (map<string, time_t>::iterator i = pending.begin();
+            i != pending.end();)
+    {
+        if (i->first != from && (!isdir || !is_under(i->first, from)))
+        {
+            ++i;
+            continue;
+        }
+        pending[to + i->first.substr(from.size())] = i->second;
+        pending.erase(i++);
+    }
+
+    if (!isdir)
+        return;
+
+    // The watches stay with the directories, under their new paths
+    for (map<int, string>::iterator i = dirs.begin(); i != dirs.end(); ++i)
+        if (i->second == from || is_under(i->second, from))
+            i->second = to + i->second.substr(from.size());
+}
+
+void LibraryWatcher::changed(const string &path)
+{
+    if (is_music(path))
+        pending[path] = time(0);
+}
+
+void LibraryWatcher::do_events()
+{
+    rename();
+    identify();
+    analyze();
+}
+
+void LibraryWatcher::rename()
+{
+    if (renames.empty())
+        return;
+
+    try {
+        AutoTransaction a;
+        for (vector<Rename>::iterator i = renames.begin();
+                i != renames.end(); ++i)
+        {
+            // The file's contents haven't changed, so neither has its
+            // identity. Anything it replaced is gone.
+            if (!i->isdir)
+            {
+                Q("UPDATE OR REPLACE Identify SET path = ? WHERE path = ?;")
+                    << i->to << i->from << execute;
+                continue;
+            }
+
+            // Everything between "dir/" and "dir0" is inside dir
+            Q("UPDATE OR REPLACE Identify SET path = ? || "
+                    "substr(path, length(?) + 1) "
+                    "WHERE path > ? AND path < ?;")
+                << i->to << i->from << i->from + "/" << i->from + "0"
+                << execute;
+        }
+        a.commit();
+    }
+    WARNIFFAILED();
+
+    for (vector<Rename>::iterator i = renames.begin();
+            i != renames.end(); ++i)
+    {
+        Song::forget_identity(i->from, i->isdir);
+        Song::forget_identity(i->to, i->isdir);
+    }
+    renames.clear();
+}
+
+void LibraryWatcher::identify()
+{
+    vector<WorkItem*> finished;
+    identifiers.collect(finished);
+    identifying -= finished.size();
+
+    if (!finished.empty())
+    {
+        try {
+            AutoTransaction a;
+            for (vector<WorkItem*>::iterator i = finished.begin();
+                    i != finished.end(); ++i)
+            {
+                Identification *id = static_cast<Identification*>(*i);
+                // Moved or deleted since
+                if (!id->file.modtime || !file_exists(id->file.path))
+                    continue;
+
+                Song song(id->file);
+#ifdef ANALYZER_ENABLED
+                if (song.isok() && !song.isanalyzed())
+                    unanalyzed.push_back(song.get_path());
+#endif
+            }
+            a.commit();
+        }
+        WARNIFFAILED();
+
+        for (vector<WorkItem*>::iterator i = finished.begin();
+                i != finished.end(); ++i)
+            delete *i;
+    }
+
+    time_t settled = time(0) - WATCH_SETTLE;
+    for (map<string, time_t>::iterator i = pending.begin();
+            i != pending.end() && identifying < WATCH_QUEUE;)
+    {
+        if (i->second > settled)
+        {
+            ++i;
+            continue;
+        }
+        identifiers.submit(new Identification(i->first));
+        ++identifying;
+        pending.erase(i++);
+    }
+}
+
+void LibraryWatcher::analyze()
+{
+#ifdef ANALYZER_ENABLED
+    if (analyzer)
+    {
+        int status = 0;
+        pid_t r = waitpid(analyzer, &status, WNOHANG);
+        if (!r)
+            return;
+        analyzer = 0;
+
+        // Another analyzer held the lock; try again later. Any other
+        // failure would most likely just happen again.
+        bool locked = r > 0 && WIFEXITED(status)
+            && WEXITSTATUS(status) == ANALYZER_LOCKED;
+        if (locked && ++analyze_tries < ANALYZE_TRIES)
+        {
+            unanalyzed.insert(unanalyzed.begin(), analyzing.begin(),
+                    analyzing.end());
+            analyze_after = time(0) + ANALYZE_RETRY;
+        }
+        else
+        {
+            if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+                LOG(ERROR) << "analyzer failed, skipping "
+                    << analyzing.size() << " files" << endl;
+            analyze_tries = 0;
+        }
+        analyzing.clear();
+    }
+
+    if (unanalyzed.empty() || time(0) < analyze_after)
+        return;
+
+    size_t count = std::min(unanalyzed.size(), (size_t)ANALYZE_BATCH);
+    analyzing.assign(unanalyzed.begin(), unanalyzed.begin() + count);
+
+    vector<char*> argv;
+    argv.push_back((char*)"analyzer");
+    for (vector<string>::iterator i = analyzing.begin();
+            i != analyzing.end(); ++i)
+        argv.push_back((char*)i->c_str());
+    argv.push_back(0);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        analyzing.clear();
+        return;
+    }
+    if (!pid)
+    {
+        execvp(argv[0], &argv[0]);
+        _exit(1);
+    }
+
+    analyzer = pid;
+    unanalyzed.erase(unanalyzed.begin(), unanalyzed.begin() + count);
+#endif
+}
+
+#endif
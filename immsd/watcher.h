@@ -0,0 +1,114 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __WATCHER_H
+#define __WATCHER_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <glib.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "immsconf.h"
+#include "song.h"
+#include "workqueue.h"
+
+using std::string;
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+struct inotify_event;
+
+// Watches music directories with inotify, so that files which are added
+// or changed get identified, and analyzed, before a player first reports
+// them. Files moved or renamed within the watched trees just have their
+// path updated in Identify.
+class LibraryWatcher
+{
+public:
+    LibraryWatcher();
+    ~LibraryWatcher();
+
+    bool isok() { return fd >= 0; }
+    // Watches root and every directory below it
+    void add_root(const string &root);
+
+    // Called from the main loop, while the database is open
+    void do_events();
+
+private:
+    // A changed file, checksummed and with its tags read off the main
+    // thread
+    class Identification : public WorkItem
+    {
+    public:
+        Identification(const string &path) : file(path) {}
+        void run() { if (file.stat()) file.read(); }
+
+        SongFile file;
+    };
+
+    static gboolean read_event(GIOChannel *source, GIOCondition condition,
+            gpointer data);
+    void read_events();
+    void handle_event(const struct inotify_event *event);
+
+    void watch_tree(const string &dir, bool queue_files);
+    void unwatch_tree(const string &dir);
+    void moved(const string &from, const string &to, bool isdir);
+    void changed(const string &path);
+
+    void rename();
+    void identify();
+    void analyze();
+
+    int fd;
+    GIOChannel *channel;
+    guint tag;
+
+    // Watched directories by watch descriptor
+    std::map<int, string> dirs;
+    // Paths that were moved away and whether they are directories, by
+    // cookie, until the matching move to arrives
+    std::map<uint32_t, std::pair<string, bool> > moves;
+    // Changed files by the time of their last change
+    std::map<string, time_t> pending;
+    // Moves within the watched trees, to be applied to Identify
+    struct Rename
+    {
+        string from, to;
+        bool isdir;
+    };
+    std::vector<Rename> renames;
+
+    WorkQueue identifiers;
+    int identifying;
+
+    std::vector<string> unanalyzed, analyzing;
+    pid_t analyzer;
+    time_t analyze_after;
+    int analyze_tries;
+};
+
+#endif
+
+#endif
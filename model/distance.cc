@@ -47,7 +47,7 @@ float KL_Divergence(const Gaussian &g1, const Gaussian &g2)
     return total;
 }
 
-float EMD::cost[NUMGAUSS][NUMGAUSS];
+__thread float EMD::cost[NUMGAUSS][NUMGAUSS];
 
 float EMD::raw_distance(const MixtureModel &m1, const MixtureModel &m2)
 {
@@ -69,7 +69,7 @@ float EMD::raw_distance(const MixtureModel &m1, const MixtureModel &m2)
     return emd(&s1, &s2, EMD::gauss_dist, 0, 0);
 }
 
-static bool normalize_beat_graph(float beats[BEATSSIZE], float *output, int comb)
+static bool normalize_beat_graph(const float beats[BEATSSIZE], float *output, int comb)
 {
     float sum = 0, min = 1e100;
 
@@ -91,7 +91,8 @@ static bool normalize_beat_graph(float beats[BEATSSIZE], float *output, int comb
     return true;
 }
 
-float EMD::raw_distance(float beats1[BEATSSIZE], float beats2[BEATSSIZE])
+float EMD::raw_distance(const float beats1[BEATSSIZE],
+        const float beats2[BEATSSIZE])
 {
     static const int comb = 5;
     static const int OUTSIZE = DIVROUNDUP(BEATSSIZE, comb);
@@ -28,15 +28,19 @@
 
 struct EMD {
     static float raw_distance(const MixtureModel &m1, const MixtureModel &m2);
-    static float raw_distance(float beats1[BEATSSIZE], float beats2[BEATSSIZE]);
+    static float raw_distance(const float beats1[BEATSSIZE],
+            const float beats2[BEATSSIZE]);
 private:
     static float gauss_dist(int *f1, int *f2)
         { return cost[*f1][*f2]; }
     static float linear_dist(int *f1, int *f2)
         { return abs(*f1 - *f2); }
-    static float cost[NUMGAUSS][NUMGAUSS];
+    // Per thread, so distances can be computed concurrently
+    static __thread float cost[NUMGAUSS][NUMGAUSS];
 };
 
+float KL_Divergence(const Gaussian &g1, const Gaussian &g2);
+
 float song_cepstr_distance(int uid1, int uid2);
 float song_bpm_distance(int uid1, int uid2);
 
@@ -64,16 +64,16 @@ typedef struct node2_t {
 } node2_t;
 
 
-/* GLOBAL VARIABLE DECLARATION */
-static int _n1, _n2;                          /* SIGNATURES SIZES */
-static float _C[MAX_SIG_SIZE1][MAX_SIG_SIZE1];/* THE COST MATRIX */
-static node2_t _X[MAX_SIG_SIZE1*2];            /* THE BASIC VARIABLES VECTOR */
+/* GLOBAL VARIABLE DECLARATION (THREAD LOCAL, SO emd() IS THREAD SAFE) */
+static __thread int _n1, _n2;                          /* SIGNATURES SIZES */
+static __thread float _C[MAX_SIG_SIZE1][MAX_SIG_SIZE1];/* THE COST MATRIX */
+static __thread node2_t _X[MAX_SIG_SIZE1*2];            /* THE BASIC VARIABLES VECTOR */
 /* VARIABLES TO HANDLE _X EFFICIENTLY */
-static node2_t *_EndX, *_EnterX;
-static char _IsX[MAX_SIG_SIZE1][MAX_SIG_SIZE1];
-static node2_t *_RowsX[MAX_SIG_SIZE1], *_ColsX[MAX_SIG_SIZE1];
-static double _maxW;
-static float _maxC;
+static __thread node2_t *_EndX, *_EnterX;
+static __thread char _IsX[MAX_SIG_SIZE1][MAX_SIG_SIZE1];
+static __thread node2_t *_RowsX[MAX_SIG_SIZE1], *_ColsX[MAX_SIG_SIZE1];
+static __thread double _maxW;
+static __thread float _maxC;
 
 /* DECLARATION OF FUNCTIONS */
 static float init(signature_t *Signature1, signature_t *Signature2,
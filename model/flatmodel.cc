@@ -0,0 +1,208 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <math.h>
+#include <string.h>
+
+#include "flatmodel.h"
+
+using std::string;
+using std::vector;
+
+bool FlatModel::attach(const char *data, size_t size)
+{
+    header = 0;
+
+    if (size < sizeof(FlatModelHeader))
+        return false;
+
+    // Mapped files are page aligned, but the embedded copy might not be
+    if ((uintptr_t)data % sizeof(float))
+    {
+        storage.resize((size + sizeof(float) - 1) / sizeof(float));
+        memcpy(&storage[0], data, size);
+        data = (const char *)&storage[0];
+    }
+
+    const FlatModelHeader *h = (const FlatModelHeader *)data;
+    if (strncmp(h->magic, FLAT_MODEL_MAGIC, sizeof(h->magic))
+            || h->version != FLAT_MODEL_VERSION)
+        return false;
+
+    size_t floats = 2 * (size_t)h->num_inputs
+        + (size_t)h->num_sv * (h->num_inputs + 1);
+    if (size < sizeof(FlatModelHeader) + floats * sizeof(float))
+        return false;
+
+    means = (const float *)(h + 1);
+    stdvs = means + h->num_inputs;
+    alphas = stdvs + h->num_inputs;
+    svs = alphas + h->num_sv;
+    header = h;
+    return true;
+}
+
+float FlatModel::evaluate(const float *features) const
+{
+    if (!header)
+        return 0;
+
+    const int n = header->num_inputs;
+    vector<float> x(n);
+    for (int i = 0; i < n; ++i)
+        x[i] = (features[i] - means[i]) / stdvs[i];
+
+    // Accumulate in double, the coefficients are large and cancel out
+    double sum = 0;
+    const float *sv = svs;
+    for (uint32_t i = 0; i < header->num_sv; ++i, sv += n)
+    {
+        double dist = 0;
+        for (int j = 0; j < n; ++j)
+            dist += (x[j] - sv[j]) * (x[j] - sv[j]);
+        sum += alphas[i] * exp(-header->gamma * dist);
+    }
+
+    return sum + header->b;
+}
+
+// Sequential reader for Torch's tagged XFile records:
+//   int32 tag length, tag, int32 element size, int32 count, data
+// Torch writes them little endian regardless of the host.
+class XFileReader
+{
+public:
+    XFileReader(const char *data, size_t size)
+        : cur((const unsigned char *)data),
+          end((const unsigned char *)data + size) {}
+
+    bool next(const string &tag, int count, vector<uint32_t> *values)
+    {
+        uint32_t taglen, elemsize, n;
+        if (!word(&taglen) || (size_t)(end - cur) < taglen)
+            return false;
+        if (string((const char *)cur, taglen) != tag)
+            return false;
+        cur += taglen;
+
+        if (!word(&elemsize) || elemsize != 4 || !word(&n))
+            return false;
+        if (count >= 0 && n != (uint32_t)count)
+            return false;
+
+        values->resize(n);
+        for (uint32_t i = 0; i < n; ++i)
+            if (!word(&(*values)[i]))
+                return false;
+        return true;
+    }
+
+    bool next_int(const string &tag, int *value)
+    {
+        vector<uint32_t> v;
+        if (!next(tag, 1, &v))
+            return false;
+        *value = (int32_t)v[0];
+        return true;
+    }
+
+    bool next_floats(const string &tag, int count, vector<float> *values)
+    {
+        vector<uint32_t> v;
+        if (!next(tag, count, &v))
+            return false;
+        values->resize(v.size());
+        for (size_t i = 0; i < v.size(); ++i)
+            memcpy(&(*values)[i], &v[i], sizeof(float));
+        return true;
+    }
+
+private:
+    bool word(uint32_t *w)
+    {
+        if (end - cur < 4)
+            return false;
+        *w = cur[0] | (cur[1] << 8) | (cur[2] << 16) | ((uint32_t)cur[3] << 24);
+        cur += 4;
+        return true;
+    }
+
+    const unsigned char *cur, *end;
+};
+
+static void append(string *out, const void *data, size_t size)
+{
+    out->append((const char *)data, size);
+}
+
+bool flat_model_from_xfile(const char *data, size_t size, float stdv,
+        string *flat)
+{
+    XFileReader xfile(data, size);
+
+    // MeanVarNorm
+    vector<float> means, stdvs;
+    if (!xfile.next_floats("IMEANS", -1, &means))
+        return false;
+    if (!xfile.next_floats("ISTDVS", means.size(), &stdvs))
+        return false;
+
+    // SVM
+    vector<float> b, alphas;
+    int num_sv, num_bound, num_frames, frame_size;
+    if (!xfile.next_floats("b", 1, &b)
+            || !xfile.next_int("NSV", &num_sv)
+            || !xfile.next_int("NSVB", &num_bound)
+            || !xfile.next_floats("SVALPHA", num_sv, &alphas)
+            || !xfile.next_int("NTF", &num_frames)
+            || !xfile.next_int("FS", &frame_size))
+        return false;
+
+    if (frame_size != (int)means.size() || num_frames != num_sv)
+        return false;
+
+    vector<float> svs;
+    svs.reserve(num_sv * frame_size);
+    for (int i = 0; i < num_sv; ++i)
+    {
+        int n;
+        vector<float> frame;
+        if (!xfile.next_int("NF", &n) || n != 1)
+            return false;
+        if (!xfile.next_floats("FRAME", frame_size, &frame))
+            return false;
+        svs.insert(svs.end(), frame.begin(), frame.end());
+    }
+
+    FlatModelHeader header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, FLAT_MODEL_MAGIC, sizeof(header.magic));
+    header.version = FLAT_MODEL_VERSION;
+    header.num_inputs = frame_size;
+    header.num_sv = num_sv;
+    header.gamma = 1. / (stdv * stdv);
+    header.b = b[0];
+
+    flat->clear();
+    append(flat, &header, sizeof(header));
+    append(flat, &means[0], means.size() * sizeof(float));
+    append(flat, &stdvs[0], stdvs.size() * sizeof(float));
+    append(flat, &alphas[0], alphas.size() * sizeof(float));
+    append(flat, &svs[0], svs.size() * sizeof(float));
+    return true;
+}
@@ -0,0 +1,77 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __FLATMODEL_H
+#define __FLATMODEL_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define FLAT_MODEL_MAGIC    "IMMSSVM"
+#define FLAT_MODEL_VERSION  1
+
+// Layout of a trained similarity model as stored on disk and embedded into
+// the binary. Everything is in host byte order and 4 byte aligned, so a
+// mapped file is used in place without any parsing:
+//
+//   FlatModelHeader
+//   float means[num_inputs]            input normalization
+//   float stdvs[num_inputs]
+//   float alphas[num_sv]               signed support vector coefficients
+//   float svs[num_sv * num_inputs]     normalized support vectors
+struct FlatModelHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_inputs;
+    uint32_t num_sv;
+    float gamma;            // the kernel is exp(-gamma * |x - sv|^2)
+    float b;
+    uint32_t reserved;
+};
+
+// Gaussian kernel SVM evaluated straight from the flat format.
+class FlatModel
+{
+public:
+    FlatModel() : header(0), means(0), stdvs(0), alphas(0), svs(0) {}
+
+    // Use the model in data, which has to stay valid for the lifetime of
+    // this object unless it had to be copied to fix up alignment.
+    bool attach(const char *data, size_t size);
+    bool isok() const { return header != 0; }
+    void detach() { header = 0; }
+
+    int num_inputs() const { return header->num_inputs; }
+    float evaluate(const float *features) const;
+
+private:
+    const FlatModelHeader *header;
+    const float *means, *stdvs, *alphas, *svs;
+    std::vector<float> storage;
+};
+
+// Convert a model saved through Torch XFiles (a MeanVarNorm followed by an
+// SVMClassification) into the flat format. The kernel width is not part of
+// the XFile and has to be supplied.
+bool flat_model_from_xfile(const char *data, size_t size, float stdv,
+        std::string *flat);
+
+#endif
@@ -22,10 +22,29 @@
 #include <memory>
 #include <vector>
 
-#define NUM_FEATURES 12
+#include <analyzer/mfcckeeper.h>
+#include <analyzer/beatkeeper.h>
+
+#define NUM_FEATURES    12
+#define NUM_PARTITIONS  3
 
 class Song;
-class MixtureModel;
+
+// Acoustic data of a single track along with the features derived from it
+// that don't depend on what the track is being compared to. Deriving them
+// once per load leaves only the two EMD kernels to run for every pair.
+struct AcousticFeatures
+{
+    AcousticFeatures() : valid(false) {}
+    bool load(const Song &song);
+    void set(const MixtureModel &mm, const float *beats);
+
+    bool valid;
+    MixtureModel mm;
+    float beats[BEATSSIZE];
+    float partitions[NUM_PARTITIONS];
+    float beats_max, beats_min;
+};
 
 class Model
 {
@@ -46,15 +65,12 @@ public:
     SimilarityModel(Model *model);
     ~SimilarityModel();
     float evaluate(const Song &s1, const Song &s2);
-    float evaluate(const MixtureModel &mm1, float *beats1,
-                   const MixtureModel &mm2, float *beats2);
+    float evaluate(const AcousticFeatures &a1, const AcousticFeatures &a2);
 
     float evaluate(float *features);
 
-    static void extract_features(
-            const MixtureModel &mm1, float *beats1,
-            const MixtureModel &mm2, float *beats2,
-            std::vector<float> *features);
+    static void extract_features(const AcousticFeatures &a1,
+            const AcousticFeatures &a2, float features[NUM_FEATURES]);
 private:
     std::auto_ptr<Model> model;
 };
@@ -0,0 +1,186 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <math.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "screening.h"
+#include "distance.h"
+
+using std::vector;
+
+// Spread of the two EMD features as seen by the normalizer of the built in
+// model; used to put the two screening terms on a comparable scale.
+#define MFCC_DISTANCE_SCALE     39.2
+#define BEAT_DISTANCE_SCALE     0.415
+
+void ScreeningKey::set(const AcousticFeatures &acoustic)
+{
+    const MixtureModel &mm = acoustic.mm;
+    const int dims = Gaussian::NumDimensions;
+
+    float total = 0;
+    for (int i = 0; i < NUMGAUSS; ++i)
+        total += mm.gauss[i].weight;
+    if (total <= 0)
+        total = 1;
+
+    collapsed.weight = 1;
+    for (int d = 0; d < dims; ++d)
+    {
+        float mean = 0, moment = 0;
+        for (int i = 0; i < NUMGAUSS; ++i)
+        {
+            const Gaussian &g = mm.gauss[i];
+            float w = g.weight / total;
+            mean += w * g.means[d];
+            moment += w * (g.vars[d] + g.means[d] * g.means[d]);
+        }
+        collapsed.means[d] = mean;
+        collapsed.vars[d] = moment - mean * mean;
+    }
+
+    // Comb and scale the beat graph exactly the way EMD::raw_distance does
+    static const int comb = 5;
+    float bins[BeatBins], sum = 0;
+    std::fill(bins, bins + BeatBins, 0);
+    for (int i = 0; i < BEATSSIZE; ++i)
+        sum += acoustic.beats[i];
+
+    beats_valid = sum != 0;
+    if (!beats_valid)
+        return;
+
+    float scale = 100.0 / sum;
+    for (int i = 0; i < BEATSSIZE; ++i)
+        bins[i / comb] += acoustic.beats[i] * scale;
+
+    float running = 0;
+    for (int i = 0; i < BeatBins; ++i)
+        beat_cdf[i] = (running += bins[i]);
+}
+
+float screening_distance(const ScreeningKey &k1, const ScreeningKey &k2)
+{
+    float mfcc = KL_Divergence(k1.collapsed, k2.collapsed);
+
+    // With a linear ground distance the EMD between two one dimensional
+    // histograms of equal mass is the L1 distance between their CDFs, so
+    // this term matches EMD::raw_distance without running the solver.
+    // Without a beat graph to compare, a track is taken to be as far off
+    // as two beat graphs can be, so it never screens in ahead of one.
+    float beats = ScreeningKey::BeatBins - 1;
+    if (k1.beats_valid && k2.beats_valid)
+    {
+        beats = 0;
+        for (int i = 0; i < ScreeningKey::BeatBins - 1; ++i)
+            beats += fabs(k1.beat_cdf[i] - k2.beat_cdf[i]);
+        beats /= 100;
+    }
+
+    return mfcc / MFCC_DISTANCE_SCALE + beats / BEAT_DISTANCE_SCALE;
+}
+
+static bool closer(const RankedCandidate &a, const RankedCandidate &b)
+{
+    return a.distance < b.distance;
+}
+
+static bool better(const RankedCandidate &a, const RankedCandidate &b)
+{
+    if (a.exact != b.exact)
+        return a.exact;
+    if (a.exact)
+        return a.score > b.score;
+    return a.distance < b.distance;
+}
+
+void TwoTierScorer::rank(const AcousticFeatures &pivot,
+        const vector<AcousticFeatures> &candidates,
+        vector<RankedCandidate> *ranked)
+{
+    rank(pivot, candidates, tier, ranked);
+}
+
+void TwoTierScorer::rank(const AcousticFeatures &pivot,
+        const vector<AcousticFeatures> &candidates, Tier tier,
+        vector<RankedCandidate> *ranked)
+{
+    ranked->resize(candidates.size());
+    for (unsigned i = 0; i < candidates.size(); ++i)
+    {
+        RankedCandidate &r = (*ranked)[i];
+        r.index = i;
+        r.distance = 0;
+        r.score = 0;
+        r.exact = false;
+    }
+
+    vector<RankedCandidate>::iterator rescore_end = ranked->end();
+
+    if (tier == Screened)
+    {
+        ScreeningKey pivot_key(pivot);
+        for (unsigned i = 0; i < candidates.size(); ++i)
+            (*ranked)[i].distance = screening_distance(pivot_key,
+                    ScreeningKey(candidates[i]));
+
+        int depth = std::min<int>(rescore_depth, ranked->size());
+        rescore_end = ranked->begin() + depth;
+        std::partial_sort(ranked->begin(), rescore_end, ranked->end(),
+                closer);
+    }
+
+    for (vector<RankedCandidate>::iterator i = ranked->begin();
+            i != rescore_end; ++i)
+    {
+        i->score = model.evaluate(pivot, candidates[i->index]);
+        i->exact = true;
+    }
+
+    std::sort(ranked->begin(), ranked->end(), better);
+}
+
+float TwoTierScorer::recall(const AcousticFeatures &pivot,
+        const vector<AcousticFeatures> &candidates, int k)
+{
+    k = std::min<int>(k, candidates.size());
+    if (k <= 0)
+        return 1;
+
+    vector<RankedCandidate> exact, screened;
+    rank(pivot, candidates, Exact, &exact);
+    rank(pivot, candidates, Screened, &screened);
+
+    vector<int> truth, found;
+    for (int i = 0; i < k; ++i)
+    {
+        truth.push_back(exact[i].index);
+        found.push_back(screened[i].index);
+    }
+    std::sort(truth.begin(), truth.end());
+    std::sort(found.begin(), found.end());
+
+    vector<int> common;
+    std::set_intersection(truth.begin(), truth.end(),
+            found.begin(), found.end(), std::back_inserter(common));
+
+    return common.size() / (float)k;
+}
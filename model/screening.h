@@ -0,0 +1,92 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __SCREENING_H
+#define __SCREENING_H
+
+#include <vector>
+
+#include <immsutil.h>
+
+#include "model.h"
+
+// Cheap stand-in for a track's acoustic data: its mixture collapsed into a
+// single moment matched gaussian, and the cumulative distribution of its
+// combed beat graph.
+struct ScreeningKey
+{
+    ScreeningKey() {}
+    ScreeningKey(const AcousticFeatures &acoustic) { set(acoustic); }
+    void set(const AcousticFeatures &acoustic);
+
+    static const int BeatBins = DIVROUNDUP(BEATSSIZE, 5);
+
+    bool beats_valid;
+    Gaussian collapsed;
+    float beat_cdf[BeatBins];
+};
+
+float screening_distance(const ScreeningKey &k1, const ScreeningKey &k2);
+
+struct RankedCandidate
+{
+    int index;          // into the candidate list passed to rank()
+    float distance;     // screening distance
+    float score;        // similarity, only meaningful if exact is set
+    bool exact;
+};
+
+// Ranks candidates by acoustic similarity to a pivot in two tiers.
+//
+// In the Screened tier everything is ordered by screening_distance() and
+// only the closest rescore_depth candidates are scored with the real
+// model; they come first, by score, followed by the rest in screening
+// order. The Exact tier scores every candidate with the model.
+class TwoTierScorer
+{
+public:
+    enum Tier { Exact, Screened };
+
+    TwoTierScorer(SimilarityModel &model, Tier tier = Screened,
+            int rescore_depth = 20)
+        : model(model), tier(tier), rescore_depth(rescore_depth) {}
+
+    void set_tier(Tier t) { tier = t; }
+    void set_rescore_depth(int depth) { rescore_depth = depth; }
+    Tier get_tier() const { return tier; }
+
+    void rank(const AcousticFeatures &pivot,
+            const std::vector<AcousticFeatures> &candidates,
+            std::vector<RankedCandidate> *ranked);
+
+    // Fraction of the exact top k that the Screened tier also puts in
+    // its top k for the same pivot.
+    float recall(const AcousticFeatures &pivot,
+            const std::vector<AcousticFeatures> &candidates, int k);
+
+private:
+    void rank(const AcousticFeatures &pivot,
+            const std::vector<AcousticFeatures> &candidates,
+            Tier tier, std::vector<RankedCandidate> *ranked);
+
+    SimilarityModel &model;
+    Tier tier;
+    int rescore_depth;
+};
+
+#endif
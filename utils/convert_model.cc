@@ -0,0 +1,82 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <string>
+#include <iostream>
+#include <fstream>
+
+#include <stdlib.h>
+
+#include <immsutil.h>
+#include <model/flatmodel.h>
+
+using std::string;
+using std::cerr;
+using std::endl;
+using std::ofstream;
+
+const string AppName = "convert_model";
+
+// Converts a model written by train_model into the flat format that
+// SVMSimilarityModel maps directly.
+int main(int argc, char *argv[])
+{
+    float stdv = 12;
+    if (argc == 5 && string(argv[1]) == "-std")
+    {
+        stdv = atof(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc != 3 || stdv <= 0)
+    {
+        cerr << "Usage: convert_model [-std <stdv>] <xfile model> <output>"
+            << endl;
+        return -1;
+    }
+
+    MappedFile in(argv[1]);
+    if (!in.isok())
+    {
+        LOG(ERROR) << "Could not open " << argv[1] << endl;
+        return -2;
+    }
+
+    string flat;
+    if (!flat_model_from_xfile(in.get_data(), in.get_size(), stdv, &flat))
+    {
+        LOG(ERROR) << argv[1] << " is not a valid model file" << endl;
+        return -3;
+    }
+
+    FlatModel check;
+    if (!check.attach(flat.data(), flat.size()))
+        return -4;
+
+    ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+    out.write(flat.data(), flat.size());
+    out.close();
+    if (!out)
+    {
+        LOG(ERROR) << "Could not write " << argv[2] << endl;
+        return -5;
+    }
+
+    return 0;
+}
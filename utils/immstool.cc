@@ -46,6 +46,7 @@
 #include <analyzer/mfcckeeper.h>
 #include <model/distance.h>
 #include <model/model.h>
+#include <model/screening.h>
 
 using std::string;
 using std::cout;
@@ -68,9 +69,12 @@ void do_missing();
 void do_purge(const string &path);
 void do_closest(const string &path);
 void do_lint();
+int do_compact(ImmsDb &immsdb);
 void do_identify(const string &path);
 void do_update_ratings();
+int do_verify_ratings();
 void do_update_distances();
+void do_rank(const string &path, int k, const string &mode);
 
 int main(int argc, char *argv[])
 {
@@ -86,12 +90,15 @@ int main(int argc, char *argv[])
 
     if (!strcmp(argv[1], "ratings"))
     {
-        if (argc > 2)
+        if (argc > 3 || (argc == 3 && strcmp(argv[2], "verify")))
         {
             cout << "huh??" << endl;
             return -1;
         }
 
+        if (argc == 3)
+            return do_verify_ratings();
+
         do_update_ratings();
     }
     else if (!strcmp(argv[1], "distances"))
@@ -152,6 +159,18 @@ int main(int argc, char *argv[])
 
         do_closest(argv[2]);
     }
+    else if (!strcmp(argv[1], "rank"))
+    {
+        if (argc < 3 || argc > 5)
+        {
+            cout << "immstool rank <filename> [n] [exact|screened|recall]"
+                << endl;
+            return -1;
+        }
+
+        do_rank(argv[2], argc > 3 ? atoi(argv[3]) : 25,
+                argc > 4 ? argv[4] : "screened");
+    }
     else if (!strcmp(argv[1], "identify"))
     {
         if (argc < 3)
@@ -248,6 +267,10 @@ int main(int argc, char *argv[])
     {
         do_lint();
     }
+    else if (!strcmp(argv[1], "compact"))
+    {
+        return do_compact(immsdb);
+    }
     else if (!strcmp(argv[1], "help"))
     {
         do_help();
@@ -261,9 +284,9 @@ int main(int argc, char *argv[])
 int usage()
 {
     cout << "End user functionality: " << endl;
-    cout << " immstool missing|purge|lint|identify|help" << endl;
+    cout << " immstool missing|purge|lint|compact|identify|help" << endl;
     cout << "Debug functionality: " << endl;
-    cout << " immstool distances|graph" << endl;
+    cout << " immstool distances|graph|rank|ratings [verify]" << endl;
     return -1;
 }
 
@@ -279,6 +302,8 @@ void do_help()
         "  hint: 'immstool missing | sort | immstool purge' works well" << endl;
     cout << "    lint                   " <<
         "- vacuum the database" << endl;
+    cout << "    compact                " <<
+        "- decay and prune old correlations" << endl;
     cout << "    identify <filename>    " <<
         "- print information about a given file" << endl;
     cout << "    help                   " << 
@@ -413,6 +438,9 @@ void do_lint()
         Q("DELETE FROM Ratings "
                 "WHERE uid NOT IN (SELECT uid FROM Library);").execute();
 
+        Q("DELETE FROM RatingState "
+                "WHERE uid NOT IN (SELECT uid FROM Library);").execute();
+
         Q("DELETE FROM A.Acoustic "
                 "WHERE uid NOT IN (SELECT uid FROM Library);").execute();
 
@@ -433,6 +461,31 @@ void do_lint()
 
 }
 
+int do_compact(ImmsDb &immsdb)
+{
+    // A running immsd would write its own copy of the graph back over the
+    // compacted one. It compacts daily by itself anyway.
+    StackLockFile lock(get_imms_root(".immsd_lock"));
+    if (!lock.isok())
+    {
+        cerr << "immsd is running, stop it before compacting" << endl;
+        return -1;
+    }
+
+    CompactionStats stats;
+    if (!immsdb.compact_correlations(&stats))
+    {
+        cerr << "compaction failed, run it again" << endl;
+        return -1;
+    }
+
+    cout << "correlations : " << stats.edges << endl;
+    cout << "pruned       : " << stats.pruned << endl;
+    cout << "capped       : " << stats.capped << endl;
+    cout << "freed        : " << stats.bytes_freed / 1024 << "KB" << endl;
+    return 0;
+}
+
 void do_missing()
 {
     Q q("SELECT path FROM 'Identify';");
@@ -447,11 +500,19 @@ void do_missing()
 }
 
 void do_update_ratings()
+{
+    StackTimer t;
+    int rated = rebuild_ratings();
+    if (rated >= 0)
+        cout << "rated " << rated << endl;
+}
+
+int do_verify_ratings()
 {
     vector<int> uids;
     try
     {
-        Q q("SELECT DISTINCT uid FROM Journal;");
+        Q q("SELECT uid FROM RatingState;");
         while (q.next())
         {
             int uid;
@@ -461,11 +522,20 @@ void do_update_ratings()
     }
     WARNIFFAILED();
 
+    int mismatched = 0;
     for (size_t i = 0; i < uids.size(); ++i)
     {
         Song song("", uids[i]);
-        song.update_rating();
+        int stored, rescanned;
+        if (song.check_rating(stored, rescanned))
+            continue;
+        ++mismatched;
+        cout << "uid " << uids[i] << ": stored " << stored
+            << " != journal " << rescanned << endl;
     }
+
+    cout << "checked " << uids.size() << ", mismatched " << mismatched << endl;
+    return mismatched ? 1 : 0;
 }
 
 void do_update_distances()
@@ -509,11 +579,8 @@ void do_update_distances()
         }
         WARNIFFAILED();
 
-        MixtureModel m1;
-        float beats1[BEATSSIZE];
-
-        Song s1("", uid);
-        if (!s1.get_acoustic(&m1, beats1))
+        AcousticFeatures a1;
+        if (!a1.load(Song("", uid)))
             continue;
 
         try {
@@ -523,17 +590,14 @@ void do_update_distances()
 
             for (set<int>::iterator j = neigh.begin(); j != neigh.end(); ++j)
             {
-                MixtureModel m2;
-                float beats2[BEATSSIZE];
-
-                Song s2("", *j);
-                if (!s2.get_acoustic(&m2, beats2))
+                AcousticFeatures a2;
+                if (!a2.load(Song("", *j)))
                     continue;
 
                 int small = std::min(uid, *j);
                 int large = std::max(uid, *j);
 
-                int dist = ROUND(model.evaluate(m1, beats1, m2, beats2) * 100);
+                int dist = ROUND(model.evaluate(a1, a2) * 100);
 
                 // Don't bother with distance < 0.3.
                 // This way we only get a list of strongly correlated songs.
@@ -604,3 +668,67 @@ void do_closest(const string &path)
     }
     WARNIFFAILED();
 }
+
+void do_rank(const string &path, int k, const string &mode)
+{
+    AcousticFeatures pivot;
+    if (!pivot.load(Song(path_normalize(path))))
+    {
+        LOG(ERROR) << "failed to load acoustic data for " << path << endl;
+        return;
+    }
+
+    vector<int> all, uids;
+    try
+    {
+        Q q("SELECT uid FROM A.Acoustic WHERE mfcc NOTNULL AND bpm NOTNULL;");
+        while (q.next())
+        {
+            int uid;
+            q >> uid;
+            all.push_back(uid);
+        }
+    }
+    WARNIFFAILED();
+
+    vector<AcousticFeatures> candidates;
+    candidates.reserve(all.size());
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+        AcousticFeatures acoustic;
+        if (!acoustic.load(Song("", all[i])))
+            continue;
+        candidates.push_back(acoustic);
+        uids.push_back(all[i]);
+    }
+
+    SVMSimilarityModel model;
+    TwoTierScorer scorer(model, mode == "exact" ?
+            TwoTierScorer::Exact : TwoTierScorer::Screened, k);
+
+    if (mode == "recall")
+    {
+        cout << "recall@" << k << " against exact scoring: "
+            << scorer.recall(pivot, candidates, k) << endl;
+        return;
+    }
+
+    vector<RankedCandidate> ranked;
+    scorer.rank(pivot, candidates, &ranked);
+
+    try
+    {
+        Q q("SELECT path FROM Identify WHERE uid = ?;");
+        for (int i = 0; i < k && i < (int)ranked.size(); ++i)
+        {
+            q << uids[ranked[i].index];
+            string other;
+            if (q.next())
+                q >> other;
+            q.execute();
+            cout << setw(8) << ranked[i].score << " "
+                << path_get_filename(other) << endl;
+        }
+    }
+    WARNIFFAILED();
+}
@@ -30,9 +30,16 @@
 #include <torch/ClassFormatDataSet.h>
 
 #include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
 
 #include <model/model.h>
+#include <model/flatmodel.h>
 #include <immscore/immsutil.h>
 
 const string AppName = "train_model";
@@ -40,6 +47,207 @@ const string AppName = "train_model";
 using namespace Torch;
 using namespace std;
 
+// training_data writes binary matrices: the number of rows and columns
+// followed by the data. Older text files are still accepted.
+static bool is_binary_matrix(const char *file)
+{
+    MappedFile f(file);
+    if (!f.isok() || f.get_size() < 2 * sizeof(int))
+        return false;
+
+    const int *dims = (const int *)f.get_data();
+    return dims[0] > 0 && dims[1] > 0 && f.get_size() ==
+        2 * sizeof(int) + (size_t)dims[0] * dims[1] * sizeof(real);
+}
+
+// A single (C, stdv) point of the sweep evaluated on one fold.
+struct SweepJob {
+    real c_cst, stdv;
+    int fold;
+    real error;
+};
+
+struct Sweep {
+    const char *file;
+    bool binary;
+    real accuracy, cache_size;
+    int iter_shrink, k_fold;
+    vector<int> order;
+    vector<SweepJob> jobs;
+    unsigned next_job;
+    pthread_mutex_t lock;
+};
+
+static vector<real> parse_list(const char *list)
+{
+    vector<real> values;
+    char *end;
+    for (real value = strtod(list, &end); end != list;
+            value = strtod(list, &end))
+    {
+        values.push_back(value);
+        list = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+static SweepJob *next_sweep_job(Sweep *sweep)
+{
+    SweepJob *job = 0;
+    pthread_mutex_lock(&sweep->lock);
+    if (sweep->next_job < sweep->jobs.size())
+        job = &sweep->jobs[sweep->next_job++];
+    pthread_mutex_unlock(&sweep->lock);
+    return job;
+}
+
+// Every worker loads its own copy of the data and builds its own kernel,
+// SVM and trainer for each job, so nothing Torch related is shared.
+static void *sweep_worker(void *arg)
+{
+    Sweep *sweep = (Sweep *)arg;
+    Allocator allocator;
+
+    MatDataSet *mat_data = new(&allocator) MatDataSet(
+            sweep->file, -1, 1, false, -1, sweep->binary);
+    MeanVarNorm *mv_norm = new(&allocator) MeanVarNorm(mat_data);
+    mat_data->preProcess(mv_norm);
+
+    Sequence *class_labels = new(&allocator) Sequence(2, 1);
+    class_labels->frames[0][0] = -1;
+    class_labels->frames[0][1] = 1;
+    DataSet *data =
+        new(&allocator) ClassFormatDataSet(mat_data, class_labels);
+    TwoClassFormat *class_format = new(&allocator) TwoClassFormat(data);
+
+    const vector<int> &order = sweep->order;
+    for (SweepJob *job; (job = next_sweep_job(sweep));)
+    {
+        vector<int> train, test;
+        for (unsigned i = 0; i < order.size(); ++i)
+            (i % sweep->k_fold == (unsigned)job->fold ? test : train)
+                .push_back(order[i]);
+
+        GaussianKernel kernel(1./(job->stdv*job->stdv));
+        SVMClassification svm(&kernel);
+        svm.setROption("C", job->c_cst);
+        svm.setROption("cache size", sweep->cache_size);
+
+        QCTrainer trainer(&svm);
+        trainer.setROption("end accuracy", sweep->accuracy);
+        trainer.setIOption("iter shrink", sweep->iter_shrink);
+
+        data->pushSubset(&train[0], train.size());
+        trainer.train(data, NULL);
+        data->popSubset();
+
+        int wrong = 0;
+        for (unsigned i = 0; i < test.size(); ++i)
+        {
+            data->setExample(test[i]);
+            svm.forward(data->inputs);
+            if (class_format->getClass(data->targets->frames[0])
+                    != class_format->getClass(svm.outputs->frames[0]))
+                ++wrong;
+        }
+        job->error = test.empty() ? 0 : (real)wrong / test.size();
+    }
+
+    return 0;
+}
+
+// Cross validates every combination of the given C and stdv values
+// concurrently, prints the results and returns the best combination.
+static bool sweep_parameters(Sweep *sweep, int n_examples,
+        const vector<real> &c_csts, const vector<real> &stdvs,
+        real *best_c_cst, real *best_stdv)
+{
+    if (c_csts.empty() || stdvs.empty() || sweep->k_fold < 2
+            || n_examples < sweep->k_fold)
+        return false;
+
+    sweep->order.resize(n_examples);
+    Random::getShuffledIndices(&sweep->order[0], n_examples);
+
+    for (unsigned c = 0; c < c_csts.size(); ++c)
+        for (unsigned s = 0; s < stdvs.size(); ++s)
+            for (int fold = 0; fold < sweep->k_fold; ++fold)
+            {
+                SweepJob job = { c_csts[c], stdvs[s], fold, 0 };
+                sweep->jobs.push_back(job);
+            }
+
+    sweep->next_job = 0;
+    pthread_mutex_init(&sweep->lock, 0);
+
+    long cpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    vector<pthread_t> threads(std::min((size_t)cpus, sweep->jobs.size()));
+    unsigned started = 0;
+    for (unsigned i = 0; i < threads.size(); ++i)
+        if (!pthread_create(&threads[started], 0, sweep_worker, sweep))
+            ++started;
+
+    // Nothing could be started, do it all on this thread
+    if (!started)
+        sweep_worker(sweep);
+
+    for (unsigned i = 0; i < started; ++i)
+        pthread_join(threads[i], 0);
+
+    pthread_mutex_destroy(&sweep->lock);
+
+    cout << setw(10) << "C" << setw(10) << "stdv"
+        << setw(10) << "error" << setw(10) << "min"
+        << setw(10) << "max" << endl;
+
+    real best_error = 2;
+    for (unsigned i = 0; i < sweep->jobs.size(); i += sweep->k_fold)
+    {
+        real total = 0, min = 1, max = 0;
+        for (int fold = 0; fold < sweep->k_fold; ++fold)
+        {
+            real error = sweep->jobs[i + fold].error;
+            total += error;
+            min = std::min(min, error);
+            max = std::max(max, error);
+        }
+
+        const SweepJob &job = sweep->jobs[i];
+        real error = total / sweep->k_fold;
+        cout << setw(10) << job.c_cst << setw(10) << job.stdv
+            << setw(10) << error << setw(10) << min
+            << setw(10) << max << endl;
+
+        if (error < best_error)
+        {
+            best_error = error;
+            *best_c_cst = job.c_cst;
+            *best_stdv = job.stdv;
+        }
+    }
+
+    cout << "BEST       : C = " << *best_c_cst << ", stdv = " << *best_stdv
+        << ", error = " << best_error << endl;
+    return true;
+}
+
+// The XFile doesn't record the kernel width, so a model trained with
+// swept parameters is written out in the flat format, which does.
+static bool write_flat_model(const string &xfile, const string &output,
+        real stdv)
+{
+    MappedFile in(xfile);
+    string flat;
+    if (!in.isok() || !flat_model_from_xfile(in.get_data(), in.get_size(),
+                stdv, &flat))
+        return false;
+
+    ofstream out(output.c_str(), ios::binary | ios::trunc);
+    out.write(flat.data(), flat.size());
+    out.close();
+    return out;
+}
+
 int main(int argc, char **argv)
 {
   char *file;
@@ -47,6 +255,8 @@ int main(int argc, char **argv)
   real accuracy, cache_size;
   int iter_shrink, k_fold;
   char *model_file;
+  char *c_list, *stdv_list;
+  bool swept = false;
 
   Allocator *allocator = new Allocator;
 
@@ -103,9 +313,59 @@ int main(int argc, char **argv)
   cmd.addSCmdArg("model", &model_file, "the model file");
   cmd.addSCmdArg("file", &file, "the test file");
 
+  // Sweep mode: cross validate a grid of parameters, then train and save
+  // a model with the best ones
+  cmd.addMasterSwitch("--sweep");
+  cmd.addText("\nArguments:");
+  cmd.addSCmdArg("file", &file, "the train file");
+  cmd.addSCmdArg("model", &model_file, "the model file");
+  cmd.addICmdArg("k", &k_fold, "number of folds");
+
+  cmd.addText("\nModel Options:");
+  cmd.addSCmdOption("-cs", &c_list, "1,10,100,1000",
+          "comma separated trade off csts to try");
+  cmd.addSCmdOption("-stds", &stdv_list, "6,9,12,15,18",
+          "comma separated gaussian kernel stds to try");
+
+  cmd.addText("\nLearning Options:");
+  cmd.addRCmdOption("-e", &accuracy, 0.01, "end accuracy");
+  cmd.addRCmdOption("-m", &cache_size, 50., "cache size in Mo per thread");
+  cmd.addICmdOption("-h", &iter_shrink, 100,
+          "minimal number of iterations before shrinking");
+
   // Read the command line
   int mode = cmd.read(argc, argv);
 
+  bool binary = is_binary_matrix(file);
+
+  if(mode == 4)
+  {
+    Random::seed();
+
+    MatDataSet *sizes =
+        new(allocator) MatDataSet(file, -1, 1, false, -1, binary);
+
+    Sweep sweep;
+    sweep.file = file;
+    sweep.binary = binary;
+    sweep.accuracy = accuracy;
+    sweep.cache_size = cache_size;
+    sweep.iter_shrink = iter_shrink;
+    sweep.k_fold = k_fold;
+
+    if (!sweep_parameters(&sweep, sizes->n_examples, parse_list(c_list),
+                parse_list(stdv_list), &c_cst, &stdv))
+    {
+      cerr << "Nothing to sweep over" << endl;
+      delete allocator;
+      return -1;
+    }
+
+    // Continue as a regular training run with the best parameters
+    mode = 0;
+    swept = true;
+  }
+
   DiskXFile *model = NULL;
   if(mode >= 2)
     model = new(allocator) DiskXFile(model_file, "r");
@@ -127,9 +387,9 @@ int main(int argc, char **argv)
 
   // Create the training dataset
   MatDataSet *mat_data =
-      new(allocator) MatDataSet(file, -1, 1, false, -1, false);
+      new(allocator) MatDataSet(file, -1, 1, false, -1, binary);
   MatDataSet *orig_mat_data =
-      new(allocator) MatDataSet(file, -1, 1, false, -1, false);
+      new(allocator) MatDataSet(file, -1, 1, false, -1, binary);
   Sequence *class_labels = new(allocator) Sequence(2, 1);
   class_labels->frames[0][0] = -1;
   class_labels->frames[0][1] = 1;
@@ -173,9 +433,25 @@ int main(int argc, char **argv)
     trainer.train(data, NULL);
     message("%d SV with %d at bounds", svm->n_support_vectors,
             svm->n_support_vectors_bound);
-    DiskXFile model_(model_file, "w");
-    mv_norm->saveXFile(&model_);
-    svm->saveXFile(&model_);
+    string xfile = string(model_file) + (swept ? ".xfile" : "");
+    {
+      DiskXFile model_(xfile.c_str(), "w");
+      mv_norm->saveXFile(&model_);
+      svm->saveXFile(&model_);
+    }
+
+    if (swept)
+    {
+      if (!write_flat_model(xfile, model_file, stdv))
+      {
+        cerr << "Could not write " << model_file << ", convert " << xfile
+            << " with: convert_model -std " << stdv << endl;
+        delete allocator;
+        return -1;
+      }
+      cout << "Wrote " << model_file << " with stdv = " << stdv
+          << ", the XFile is kept in " << xfile << endl;
+    }
   }
 
   // KFold
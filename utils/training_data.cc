@@ -21,7 +21,8 @@
 #include <iomanip>
 #include <fstream>
 #include <vector>
-#include <list>
+#include <deque>
+#include <map>
 #include <algorithm>
 
 #include <assert.h>
@@ -29,6 +30,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 
 #include <imms.h>
 #include <song.h>
@@ -48,7 +50,8 @@ using std::cerr;
 using std::endl;
 using std::cin;
 using std::vector;
-using std::list;
+using std::deque;
+using std::map;
 using std::ofstream;
 
 const string AppName = IMMSTOOL_APP;
@@ -59,7 +62,10 @@ struct Sample {
 };
 
 typedef vector<Sample> Samples;
-typedef list< vector<float> > Features;
+
+// Row major, NUM_FEATURES inputs followed by the class of each row.
+static const int NUM_COLUMNS = NUM_FEATURES + 1;
+typedef vector<float> FeatureMatrix;
 
 void collect_samples(Samples *samples,
         const string &table_name, int CLASS)
@@ -78,31 +84,122 @@ void collect_samples(Samples *samples,
     stats.finish();
 }
 
-void collect_features(Features *features, const Samples &samples) {
-    AutoTransaction a;
+// Acoustic data of every uid referenced by the samples. It is loaded up
+// front by the main thread, since the database can not be shared with the
+// workers.
+class AcousticCache
+{
+public:
+    // Returns the index of the uid's features, or -1 if it has none.
+    int load(int uid)
+    {
+        map<int, int>::iterator i = index.find(uid);
+        if (i != index.end())
+            return i->second;
+
+        int result = -1;
+        AcousticFeatures acoustic;
+        if (acoustic.load(Song("", uid)))
+        {
+            result = features.size();
+            features.push_back(acoustic);
+        }
+        return index[uid] = result;
+    }
+
+    const AcousticFeatures &operator[](int i) const { return features[i]; }
+
+private:
+    map<int, int> index;
+    deque<AcousticFeatures> features;
+};
+
+struct Pair {
+    int first, second;
+    float CLASS;
+};
+
+struct FeatureWorker {
+    const AcousticCache *cache;
+    const vector<Pair> *pairs;
+    float *matrix;
+    unsigned start, step;
+};
+
+// Each pair fills two rows, one for each order of the songs.
+static void *feature_worker(void *arg)
+{
+    const FeatureWorker &w = *(FeatureWorker *)arg;
+    const AcousticCache &cache = *w.cache;
+
+    for (unsigned i = w.start; i < w.pairs->size(); i += w.step)
+    {
+        const Pair &p = (*w.pairs)[i];
+        float *row = w.matrix + 2 * i * NUM_COLUMNS;
+
+        SimilarityModel::extract_features(cache[p.first], cache[p.second],
+                row);
+        row[NUM_FEATURES] = p.CLASS;
+        row += NUM_COLUMNS;
+
+        SimilarityModel::extract_features(cache[p.second], cache[p.first],
+                row);
+        row[NUM_FEATURES] = p.CLASS;
+    }
+    return 0;
+}
+
+static int num_workers()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return std::max(1L, std::min(cpus, 16L));
+}
 
-    MixtureModel mm1, mm2;
-    float b1[BEATSSIZE], b2[BEATSSIZE];
+int collect_features(FeatureMatrix *features, const Samples &samples)
+{
+    AcousticCache cache;
+    vector<Pair> pairs;
 
-    for (unsigned i = 0, size = samples.size(); i < size; ++i) {
-        const Sample &s = samples[i];
-        Song s1("", s.uid1), s2("", s.uid2);
+    {
+        AutoTransaction a;
+        for (unsigned i = 0, size = samples.size(); i < size; ++i) {
+            Pair p;
+            p.first = cache.load(samples[i].uid1);
+            p.second = cache.load(samples[i].uid2);
+            p.CLASS = samples[i].CLASS;
+            if (p.first >= 0 && p.second >= 0)
+                pairs.push_back(p);
+        }
+    }
 
-        if (!s1.get_acoustic(&mm1, b1))
-            continue;
-        if (!s2.get_acoustic(&mm2, b2))
-            continue;
+    features->resize(pairs.size() * 2 * NUM_COLUMNS);
+    if (pairs.empty())
+        return 0;
 
-        vector<float> f1;
-        SimilarityModel::extract_features(mm1, b1, mm2, b2, &f1);
-        f1.push_back(samples[i].CLASS);
-        features->push_back(f1);
+    vector<pthread_t> threads(num_workers());
+    vector<FeatureWorker> workers(threads.size());
+    unsigned started = 0;
 
-        vector<float> f2;
-        SimilarityModel::extract_features(mm2, b2, mm1, b1, &f2);
-        f2.push_back(samples[i].CLASS);
-        features->push_back(f2);
+    for (unsigned i = 0; i < threads.size(); ++i)
+    {
+        FeatureWorker &w = workers[i];
+        w.cache = &cache;
+        w.pairs = &pairs;
+        w.matrix = &(*features)[0];
+        w.start = i;
+        w.step = threads.size();
+
+        // Fall back to doing this share on the main thread
+        if (pthread_create(&threads[started], 0, feature_worker, &w))
+            feature_worker(&w);
+        else
+            ++started;
     }
+
+    for (unsigned i = 0; i < started; ++i)
+        pthread_join(threads[i], 0);
+
+    return pairs.size() * 2;
 }
 
 int main(int argc, char *argv[])
@@ -122,7 +219,6 @@ int main(int argc, char *argv[])
 
     try
     {
-        QueryCacheDisabler qcd;
         Q("CREATE TEMP TABLE Inverse "
                 "('sid' INTEGER UNIQUE NOT NULL, "
                 "'uid' INTEGER NOT NULL, "
@@ -160,27 +256,27 @@ int main(int argc, char *argv[])
 
     DEBUGVAL(samples.size());
 
-    Features features;
-    collect_features(&features, samples);
+    FeatureMatrix features;
+    int rows = collect_features(&features, samples);
 
-    DEBUGVAL(features.size());
+    DEBUGVAL(rows);
 
-    if (!features.size() || !features.front().size())
+    if (!rows)
         return -3;
 
-    ofstream f(argv[2]);
-    f << features.size() << " " << features.front().size() << endl;
+    // Binary matrix as read by Torch's MatDataSet: the number of rows and
+    // columns followed by the data, in host byte order.
+    int dims[2] = { rows, NUM_COLUMNS };
+    ofstream f(argv[2], std::ios::binary | std::ios::trunc);
+    f.write((const char *)dims, sizeof(dims));
+    f.write((const char *)&features[0], features.size() * sizeof(float));
+    f.close();
 
-    for (Features::iterator i = features.begin(); i != features.end(); ++i)
+    if (!f)
     {
-        const vector<float> &v = *i;
-        f << v[0];
-        for (unsigned j = 1, size = v.size(); j < size; ++j)
-            f << " " << v[j];
-        f << endl;
+        LOG(ERROR) << "Could not write " << argv[2] << endl;
+        return -4;
     }
 
-    f.close();
-
     return 0;
 }